@@ -0,0 +1,158 @@
+//
+//  bench.cpp
+//  dlib_utils
+//
+//  Created by zhaoyu on 2018/1/8.
+//  Copyright © 2018 zhaoyu. All rights reserved.
+//
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <cstdio>
+#include <thread>
+
+#include <model_utils.hpp>
+#include <compressed_shape_predictor.hpp>
+#include <eval_utils.hpp>
+#include <dlib/image_processing.h>
+
+/**
+ *  compress a dlib model with every combination of prune threshold, quantization
+ *  number and quantizer, and report size, save/load time, peak memory while
+ *  loading, per-face latency (one face per call, and all faces of an image in one
+ *  batch call) and landmark deviation from the original model, of the decoded dlib
+ *  model and of compressed_shape_predictor
+ */
+int main(int argc, const char * argv[]) {
+    
+    if (argc < 2) {
+        std::cout << "Usage: ./bench.bin src_path [--images dir] [--prune 0.0001,0.001] "
+                     "[--quant 128,512,2048] [--quantizer model,level,coordinate] [--packed_splits 1] "
+                     "[--coded_splits 1] [--codebook 4096] [--version 1] [--threads 4] [--synthetic 50] [--out tmp_path] [--stats stats.jsonl]" << std::endl;
+        return 0;
+    }
+    
+    std::string image_dir;
+    std::string tmp_path = "bench_model.tmp";
+    std::string stats_path;
+    std::vector<float> prune_list = {0.0001f};
+    std::vector<unsigned long long> quant_list = {128, 512, 2048};
+    std::vector<std::string> quantizer_list = {"model"};
+    unsigned long synthetic_num = 50;
+    bool packed_splits = false;
+    bool coded_splits = false;
+    unsigned long long leaf_codebook_size = 0;
+    unsigned long long version = med::MODEL_VERSION_LATEST;
+    unsigned long num_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int idx = 2; idx + 1 < argc; idx += 2) {
+        std::string key = argv[idx];
+        if (key == "--images") image_dir = argv[idx + 1];
+        else if (key == "--prune") prune_list = med::parse_list<float>(argv[idx + 1]);
+        else if (key == "--quant") quant_list = med::parse_list<unsigned long long>(argv[idx + 1]);
+        else if (key == "--quantizer") quantizer_list = med::parse_list<std::string>(argv[idx + 1]);
+        else if (key == "--packed_splits") packed_splits = std::string(argv[idx + 1]) != "0";
+        else if (key == "--coded_splits") coded_splits = std::string(argv[idx + 1]) != "0";
+        else if (key == "--codebook") leaf_codebook_size = med::parse_list<unsigned long long>(argv[idx + 1]).at(0);
+        else if (key == "--version") version = med::parse_list<unsigned long long>(argv[idx + 1]).at(0);
+        else if (key == "--threads") num_threads = med::parse_list<unsigned long>(argv[idx + 1]).at(0);
+        else if (key == "--synthetic") synthetic_num = med::parse_list<unsigned long>(argv[idx + 1]).at(0);
+        else if (key == "--out") tmp_path = argv[idx + 1];
+        else if (key == "--stats") stats_path = argv[idx + 1];
+    }
+    
+    // unknown quantizer names fail here, before any model is compressed
+    std::vector<med::quantizer_type> quantizers;
+    for (auto &name: quantizer_list) quantizers.push_back(med::parse_quantizer(name));
+    
+    dlib::shape_predictor sp;
+    dlib::deserialize(argv[1]) >> sp;
+    dlib::thread_pool pool(num_threads);
+    std::ofstream stats_os;
+    if (!stats_path.empty()) stats_os.open(stats_path);
+    
+    std::vector<med::eval_sample> samples;
+    if (!image_dir.empty()) med::load_image_samples(image_dir, samples);
+    else med::make_synthetic_samples(samples, synthetic_num);
+    unsigned long face_num = 0;
+    for (auto &sample: samples) face_num += sample.faces.size();
+    std::cout << "model: " << argv[1] << ", " << med::file_size(argv[1]) / 1024 << " KB, "
+              << samples.size() << " images, " << face_num << " faces" << std::endl;
+    std::cout << "dlib original: " << std::fixed << std::setprecision(1)
+              << med::time_per_face_us(sp, samples) << " us/face" << std::endl;
+    
+    std::cout << std::setw(10) << "prune" << std::setw(8) << "quant" << std::setw(12) << "quantizer"
+              << std::setw(10) << "size_kb" << std::setw(10) << "save_ms" << std::setw(10) << "load_ms"
+              << std::setw(10) << "load_mb" << std::setw(10) << "us/face" << std::setw(10) << "cmp_us" << std::setw(10) << "batch_us"
+              << std::setw(10) << "mean_px" << std::setw(10) << "max_px" << std::setw(10) << "mean_rel"
+              << std::setw(10) << "cmp_mean" << std::setw(10) << "cmp_max" << std::setw(10) << "cmp_rel"
+              << std::endl;
+    
+    for (auto prune_thresh: prune_list) {
+        for (auto quantization_num: quant_list) {
+            for (unsigned long quantizer_idx = 0; quantizer_idx < quantizers.size(); ++ quantizer_idx) {
+                const std::string &quantizer = quantizer_list[quantizer_idx];
+                med::compression_options options;
+                options.prune_thresh = prune_thresh;
+                options.quantization_num = quantization_num;
+                options.packed_splits = packed_splits;
+                options.coded_splits = coded_splits;
+                options.leaf_codebook_size = leaf_codebook_size;
+                options.num_threads = num_threads;
+                options.version = version;
+                options.quantizer = quantizers[quantizer_idx];
+                
+                med::model_stats save_stats, load_stats, predict_stats;
+                med::stopwatch watch;
+                med::save_shape_predictor_model(sp, tmp_path, options, &save_stats);
+                double save_ms = watch.elapsed_ms();
+                
+                dlib::shape_predictor loaded;
+                med::reset_peak_memory();
+                med::uint64 memory_before = med::current_memory_bytes();
+                watch.reset();
+                med::load_shape_predictor_model(loaded, tmp_path, 0, &load_stats);
+                double load_ms = watch.elapsed_ms();
+                med::uint64 peak = med::peak_memory_bytes();
+                double load_mb = peak > memory_before ? (peak - memory_before) / 1048576.0 : 0;
+                
+                med::compressed_shape_predictor compressed(tmp_path);
+                if (stats_os) compressed.set_stats(&predict_stats);
+                // the first prediction decodes the leaves, keep it out of the timing
+                for (auto &sample: samples) {
+                    if (sample.faces.empty()) continue;
+                    compressed(sample.img, sample.faces[0]);
+                    break;
+                }
+                med::deviation_stats deviation = med::landmark_deviation(sp, loaded, samples);
+                med::deviation_stats compressed_deviation = med::landmark_deviation(sp, compressed, samples);
+                
+                std::cout << std::setw(10) << std::setprecision(6) << std::defaultfloat << prune_thresh
+                          << std::setw(8) << quantization_num << std::setw(12) << quantizer
+                          << std::fixed << std::setprecision(1)
+                          << std::setw(10) << med::file_size(tmp_path) / 1024.0
+                          << std::setw(10) << save_ms << std::setw(10) << load_ms << std::setw(10) << load_mb
+                          << std::setw(10) << med::time_per_face_us(loaded, samples)
+                          << std::setw(10) << med::time_per_face_us(compressed, samples)
+                          << std::setw(10) << med::batch_time_per_face_us(compressed, samples, pool)
+                          << std::setprecision(3)
+                          << std::setw(10) << deviation.mean << std::setw(10) << deviation.max
+                          << std::setprecision(5) << std::setw(10) << deviation.mean_relative
+                          << std::setprecision(3)
+                          << std::setw(10) << compressed_deviation.mean << std::setw(10) << compressed_deviation.max
+                          << std::setprecision(5) << std::setw(10) << compressed_deviation.mean_relative
+                          << std::endl;
+                
+                if (stats_os) {
+                    compressed.set_stats(NULL);
+                    stats_os << "{\"prune\": " << std::defaultfloat << prune_thresh << ", \"quant\": " << quantization_num
+                             << ", \"quantizer\": \"" << quantizer << "\", \"save\": " << save_stats.to_json()
+                             << ", \"load\": " << load_stats.to_json() << ", \"predict\": " << predict_stats.to_json() << "}" << std::endl;
+                }
+            }
+        }
+    }
+    
+    std::remove(tmp_path.c_str());
+    return 0;
+}
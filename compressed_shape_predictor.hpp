@@ -0,0 +1,797 @@
+//
+//  compressed_shape_predictor.hpp
+//  dlib_utils
+//
+//  Created by zhaoyu on 2018/1/8.
+//  Copyright © 2018 zhaoyu. All rights reserved.
+//
+
+#ifndef compressed_shape_predictor_h
+#define compressed_shape_predictor_h
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#include <model_utils.hpp>
+#include <model_container.hpp>
+
+
+namespace med {
+    
+    /**
+     *  acc[i] += codes[i] for i in [0, n), widening the quantization codes to int32
+     */
+    inline void accumulate_codes(const signed char *codes, int32 *acc, unsigned long n) {
+        unsigned long idx = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+        for (; idx + 16 <= n; idx += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(codes + idx));
+            __m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+            __m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+            __m128i *a = reinterpret_cast<__m128i *>(acc + idx);
+            _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16)));
+            _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16)));
+            _mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16)));
+            _mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16)));
+        }
+#endif
+        for (; idx < n; ++ idx) acc[idx] += codes[idx];
+    }
+    
+    inline void accumulate_codes(const int16 *codes, int32 *acc, unsigned long n) {
+        unsigned long idx = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+        for (; idx + 8 <= n; idx += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(codes + idx));
+            __m128i *a = reinterpret_cast<__m128i *>(acc + idx);
+            _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)));
+            _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16)));
+        }
+#endif
+        for (; idx < n; ++ idx) acc[idx] += codes[idx];
+    }
+    
+    inline void accumulate_codes(const int32 *codes, int32 *acc, unsigned long n) {
+        unsigned long idx = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+        for (; idx + 4 <= n; idx += 4) {
+            __m128i *a = reinterpret_cast<__m128i *>(acc + idx);
+            _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_loadu_si128(reinterpret_cast<const __m128i *>(codes + idx))));
+        }
+#endif
+        for (; idx < n; ++ idx) acc[idx] += codes[idx];
+    }
+    
+    /**
+     *  acc[indices[k]] += values[k] for k in [begin, end)
+     */
+    inline void accumulate_sparse_codes(const uint16 *indices, const int16 *values, uint32 begin, uint32 end, int32 *acc) {
+        for (uint32 k = begin; k < end; ++ k) acc[indices[k]] += values[k];
+    }
+    
+    /**
+     *  x[i] = m00 * dx[i] + m01 * dy[i] + shape[anchor[i]] and
+     *  y[i] = m10 * dx[i] + m11 * dy[i] + shape[anchor[i] + 1] for i in [0, n): the
+     *  feature pool offsets of a level moved by the similarity transform of the current
+     *  shape to their anchor landmarks, where anchor holds the x coordinate index
+     */
+    inline void transform_feature_offsets(const float *dx, const float *dy, const uint32 *anchor, const float *shape,
+                                          float m00, float m01, float m10, float m11, unsigned long n, float *x, float *y) {
+        unsigned long idx = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+        const __m128 v00 = _mm_set1_ps(m00), v01 = _mm_set1_ps(m01), v10 = _mm_set1_ps(m10), v11 = _mm_set1_ps(m11);
+        for (; idx + 4 <= n; idx += 4) {
+            const __m128 vdx = _mm_loadu_ps(dx + idx), vdy = _mm_loadu_ps(dy + idx);
+            const __m128 ax = _mm_set_ps(shape[anchor[idx + 3]], shape[anchor[idx + 2]], shape[anchor[idx + 1]], shape[anchor[idx]]);
+            const __m128 ay = _mm_set_ps(shape[anchor[idx + 3] + 1], shape[anchor[idx + 2] + 1], shape[anchor[idx + 1] + 1], shape[anchor[idx] + 1]);
+            _mm_storeu_ps(x + idx, _mm_add_ps(_mm_add_ps(_mm_mul_ps(v00, vdx), _mm_mul_ps(v01, vdy)), ax));
+            _mm_storeu_ps(y + idx, _mm_add_ps(_mm_add_ps(_mm_mul_ps(v10, vdx), _mm_mul_ps(v11, vdy)), ay));
+        }
+#endif
+        for (; idx < n; ++ idx) {
+            x[idx] = m00 * dx[idx] + m01 * dy[idx] + shape[anchor[idx]];
+            y[idx] = m10 * dx[idx] + m11 * dy[idx] + shape[anchor[idx] + 1];
+        }
+    }
+    
+    /**
+     *  feature pixel values are floats, or 8-bit intensities for packed splits
+     */
+    inline void set_feature_pixel_value(float &feature, float v) {
+        feature = v;
+    }
+    
+    inline void set_feature_pixel_value(uint8 &feature, float v) {
+        feature = static_cast<uint8>(std::max(0.f, std::min(255.f, v)));
+    }
+    
+    inline void set_feature_pixel_value(uint8 &feature, unsigned char v) {
+        feature = v;
+    }
+    
+    /**
+     *  shape predictor that runs directly on a memory-mapped compressed model
+     *
+     *  Only the coded leaf values and the splits stored as they are stay in the mapped
+     *  file, shared by every instance and process that maps the same model; they are
+     *  read in place when a level is decoded. Every instance copies the rest when the
+     *  model is opened: the initial shape, the feature pool as separate dx, dy and
+     *  anchor arrays, the code tables and codebook rows, and packed or coded splits,
+     *  which are decoded into packed splits. Leaf values of a cascade level are decoded
+     *  the first time the level is used, and the splits of the level are copied next
+     *  to them.
+     *  The predictor is safe to call from several threads at once.
+     *
+     *  Leaves are never dequantized: each level keeps the quantization codes in the
+     *  narrowest of int8/int16/int32 that holds them, the trees of a level are summed
+     *  as integers, and the sum is scaled by the quantization steps once per level.
+     *  Levels whose leaves are mostly zeros after pruning keep only the non-zero codes
+     *  with their coordinates, and the update touches only those coordinates.
+     *
+     *  Every decoded level is one cache line aligned block of an arena: the splits of
+     *  its trees, breadth-first, followed by its leaves. The walk down a tree is
+     *  unrolled at compile time for the usual tree depths.
+     *
+     *  With a leaf codebook the leaves of a level are its codebook rows, and the block
+     *  also holds the 16-bit row of every tree leaf.
+     *
+     *  With packed splits the feature pool is read into 8-bit intensities and every
+     *  split compares integer pixel differences.
+     *
+     *  Several faces of one image can be predicted in one call, optionally spread over
+     *  a dlib::thread_pool.
+     *
+     *  Predictions can run only the first levels of the cascade, and the leaves of the
+     *  last levels can be decoded on a background thread while the first ones are
+     *  already in use.
+     */
+    class compressed_shape_predictor {
+    public:
+        compressed_shape_predictor() : splits_(NULL), pool_dx_(NULL), pool_dy_(NULL), pool_anchor_(NULL), max_levels_(0), decoded_levels_(0), ready_levels_(0), progressive_(false),
+                                       stop_background_(false), stats_(NULL) {}
+        
+        explicit compressed_shape_predictor(const std::string &filename) : compressed_shape_predictor() {
+            open(filename);
+        }
+        
+        compressed_shape_predictor(const uint8 *data, uint64 size) : compressed_shape_predictor() {
+            open(data, size);
+        }
+        
+        // model name of a container file, see model_container.hpp
+        compressed_shape_predictor(const std::string &filename, const std::string &name) : compressed_shape_predictor() {
+            open(filename, name);
+        }
+        
+        ~compressed_shape_predictor() {
+            stop_background();
+        }
+        
+        void open(const std::string &filename) {
+            stop_background();
+            file_.open(filename);
+            open_sections(split_sections(file_.data(), file_.size()));
+        }
+        
+        /**
+         *  run on the model name of a container file. Only the directory of the
+         *  container and the sections of this model are read.
+         */
+        void open(const std::string &filename, const std::string &name) {
+            stop_background();
+            file_.open(filename);
+            model_container container(reinterpret_cast<const uint8 *>(file_.data()), file_.size());
+            open_sections(container.sections(name));
+        }
+        
+        /**
+         *  run on the model name of an open container, which must outlive the predictor
+         */
+        void open(const model_container &container, const std::string &name) {
+            stop_background();
+            file_.close();
+            open_sections(container.sections(name));
+        }
+        
+        /**
+         *  run on a model image in memory, such as the array of a header written by
+         *  embed_model.cpp. The image is not copied and must outlive the predictor.
+         */
+        void open(const uint8 *data, uint64 size) {
+            stop_background();
+            file_.close();
+            open_sections(split_sections(reinterpret_cast<const char *>(data), size));
+        }
+        
+        const model_header &header() const { return layout_.header; }
+        unsigned long num_parts() const { return layout_.header.landmark_num; }
+        unsigned long num_cascade_levels() const { return layout_.header.cascade_depth; }
+        const dlib::matrix<float,0,1> &initial_shape() const { return initial_shape_; }
+        
+        /**
+         *  run only the first num_levels cascade levels (0 for all of them) in the
+         *  predictions that do not ask for a number of levels themselves. Fewer levels
+         *  evaluate fewer trees, at some cost in accuracy.
+         */
+        void set_cascade_levels(unsigned long num_levels) { max_levels_.store(num_levels, std::memory_order_relaxed); }
+        unsigned long cascade_levels() const { return max_levels_.load(std::memory_order_relaxed); }
+        
+        /**
+         *  decode the leaves of the first num_levels levels now and the remaining ones on
+         *  a background thread. Until a level is decoded the predictions stop before it
+         *  instead of waiting for it, so they reach full accuracy once every level is ready.
+         */
+        void load_progressively(unsigned long num_levels) {
+            stop_background();
+            const unsigned long depth = layout_.header.cascade_depth;
+            num_levels = std::min<unsigned long>(std::max(1ul, num_levels), depth);
+            for (unsigned long level = 0; level < num_levels; ++ level) ensure_level(level);
+            progressive_.store(true, std::memory_order_release);
+            if (num_levels == depth) return;
+            background_ = std::thread([this, num_levels, depth]() {
+                for (unsigned long level = num_levels; level < depth; ++ level) {
+                    if (stop_background_.load(std::memory_order_relaxed)) return;
+                    ensure_level(level);
+                }
+            });
+        }
+        
+        // number of levels decoded from the first one on
+        unsigned long ready_levels() const { return ready_levels_.load(std::memory_order_acquire); }
+        
+        void wait_until_loaded() {
+            if (background_.joinable()) background_.join();
+        }
+        
+        /**
+         *  record the decoding time of every level and the time spent in every level
+         *  by the predictions into stats, or stop recording with NULL. stats must
+         *  outlive the predictions that record into it.
+         */
+        void set_stats(model_stats *stats) {
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            if (stats) stats->level_ms.resize(layout_.header.cascade_depth, 0);
+            stats_.store(stats, std::memory_order_release);
+        }
+        
+        /**
+         *  same result as dlib::shape_predictor::operator() on the decoded model, up to
+         *  float rounding of the leaf sums
+         */
+        template <typename image_type>
+        dlib::full_object_detection operator()(const image_type &img, const dlib::rectangle &rect) const {
+            return (*this)(img, rect, 0);
+        }
+        
+        /**
+         *  shape after the first num_levels cascade levels, 0 for the default number
+         */
+        template <typename image_type>
+        dlib::full_object_detection operator()(const image_type &img, const dlib::rectangle &rect, unsigned long num_levels) const {
+            const std::vector<dlib::rectangle> rects(1, rect);
+            std::vector<dlib::full_object_detection> shapes(1);
+            predict(img, rects, 0, 1, 0, run_levels(num_levels), NULL, shapes);
+            return shapes[0];
+        }
+        
+        /**
+         *  shape after the levels [first_level, num_levels) starting from the parts of
+         *  start mapped into rect, instead of from the mean shape after the levels before
+         *  first_level. Used to carry the shape of a face over from the previous frame.
+         *  start must have num_parts() parts.
+         */
+        template <typename image_type>
+        dlib::full_object_detection operator()(const image_type &img, const dlib::rectangle &rect,
+                                               const dlib::full_object_detection &start, unsigned long first_level,
+                                               unsigned long num_levels=0) const {
+            if (start.num_parts() != num_parts()) throw dlib::error("The start shape must have the parts of the model.");
+            const std::vector<dlib::rectangle> rects(1, rect);
+            const dlib::point_transform_affine tform_from_img = dlib::impl::normalizing_tform(rect);
+            dlib::matrix<float,0,1> start_shape;
+            start_shape.set_size(initial_shape_.size(), 1);
+            for (unsigned long idx = 0; idx < start.num_parts(); ++ idx) {
+                const dlib::vector<double,2> p = tform_from_img(start.part(idx));
+                start_shape(idx * 2) = static_cast<float>(p.x());
+                start_shape(idx * 2 + 1) = static_cast<float>(p.y());
+            }
+            std::vector<dlib::full_object_detection> shapes(1);
+            predict(img, rects, 0, 1, first_level, run_levels(num_levels), &start_shape, shapes);
+            return shapes[0];
+        }
+        
+        /**
+         *  shapes of all faces in rects, batch_size faces at a time. Every tree of a level
+         *  is evaluated for the whole batch before the next tree, so its splits and leaves
+         *  are brought into cache once per batch instead of once per face.
+         */
+        template <typename image_type>
+        std::vector<dlib::full_object_detection> operator()(const image_type &img, const std::vector<dlib::rectangle> &rects,
+                                                            unsigned long batch_size=default_batch_size) const {
+            std::vector<dlib::full_object_detection> shapes(rects.size());
+            batch_size = std::max(1ul, batch_size);
+            const unsigned long num_levels = run_levels(0);
+            for (unsigned long begin = 0; begin < rects.size(); begin += batch_size) {
+                predict(img, rects, begin, std::min<unsigned long>(begin + batch_size, rects.size()), 0, num_levels, NULL, shapes);
+            }
+            return shapes;
+        }
+        
+        /**
+         *  same as above, with the batches spread over the threads of pool
+         */
+        template <typename image_type>
+        std::vector<dlib::full_object_detection> operator()(const image_type &img, const std::vector<dlib::rectangle> &rects,
+                                                            dlib::thread_pool &pool, unsigned long batch_size=default_batch_size) const {
+            std::vector<dlib::full_object_detection> shapes(rects.size());
+            batch_size = std::max(1ul, batch_size);
+            const long num_batches = static_cast<long>((rects.size() + batch_size - 1) / batch_size);
+            const unsigned long num_levels = run_levels(0);
+            dlib::parallel_for(pool, 0, num_batches, [&](long batch) {
+                const unsigned long begin = batch * batch_size;
+                predict(img, rects, begin, std::min<unsigned long>(begin + batch_size, rects.size()), 0, num_levels, NULL, shapes);
+            }, 1);
+            return shapes;
+        }
+        
+        static const unsigned long default_batch_size = 16;
+    
+    private:
+        compressed_shape_predictor(const compressed_shape_predictor &);
+        compressed_shape_predictor &operator=(const compressed_shape_predictor &);
+        
+        void open_sections(const std::vector<byte_view> &sections) {
+            parse_model_layout(sections, layout_);
+            
+            const model_header &header = layout_.header;
+            initial_shape_.set_size(header.leaf_value_num(), 1);
+            for (unsigned long idx = 0; idx < header.leaf_value_num(); ++ idx) {
+                initial_shape_(idx) = load_value<float32>(layout_.initial_shape.data + idx * sizeof(float32));
+            }
+            
+            parse_code_tables(layout_, code_tables_);
+            if (layout_.codebook_size) {
+                decode_leaf_rows(layout_, leaf_rows_);
+            } else {
+                leaf_rows_.clear();
+            }
+            splits_ = (header.flags & MODEL_FLAG_PACKED_SPLITS) ? packed_split_data(layout_, split_buffer_) : layout_.splits.data;
+            
+            const uint64 levels = header.cascade_depth;
+            arena_.clear();
+            decode_codes_.clear();
+            
+            // feature pools as separate dx, dy and anchor arrays per level
+            const uint64 pool_size = levels * header.feature_pool_size;
+            float *dx = arena_.allocate<float>(pool_size);
+            float *dy = arena_.allocate<float>(pool_size);
+            uint32 *anchor = arena_.allocate<uint32>(pool_size);
+            for (uint64 idx = 0; idx < pool_size; ++ idx) {
+                dx[idx] = load_value<float32>(layout_.deltas.data + idx * 2 * sizeof(float32));
+                dy[idx] = load_value<float32>(layout_.deltas.data + (idx * 2 + 1) * sizeof(float32));
+                anchor[idx] = 2 * static_cast<uint32>(load_value<uint8>(layout_.anchor_idx.data + idx));
+                if (anchor[idx] >= header.leaf_value_num()) throw dlib::serialization_error("Invalid anchor index in compressed model.");
+            }
+            pool_dx_ = dx;
+            pool_dy_ = dy;
+            pool_anchor_ = anchor;
+            
+            leaves_.assign(levels, level_leaves());
+            level_ready_.reset(new std::atomic<bool>[levels]);
+            for (uint64 idx = 0; idx < levels; ++ idx) level_ready_[idx].store(false);
+            level_bit_offset_.assign(levels + 1, 0);
+            if (layout_.index_block_trees) {
+                for (uint64 idx = 0; idx < levels; ++ idx) {
+                    level_bit_offset_[idx] = layout_.block_bit_offset(idx * layout_.blocks_per_level());
+                }
+            }
+            decoded_levels_ = 0;
+            ready_levels_.store(0);
+            progressive_.store(false);
+        }
+        
+        void stop_background() {
+            if (!background_.joinable()) return;
+            stop_background_.store(true, std::memory_order_relaxed);
+            background_.join();
+            stop_background_.store(false, std::memory_order_relaxed);
+        }
+        
+        /**
+         *  levels a prediction asking for num_levels levels runs: the default number if
+         *  0, and no level that is still being decoded in progressive loading
+         */
+        unsigned long run_levels(unsigned long num_levels) const {
+            unsigned long levels = layout_.header.cascade_depth;
+            if (num_levels == 0) num_levels = max_levels_.load(std::memory_order_relaxed);
+            if (num_levels) levels = std::min(levels, num_levels);
+            if (progressive_.load(std::memory_order_acquire)) levels = std::min(levels, ready_levels());
+            return levels;
+        }
+        
+        template <typename image_type>
+        void predict(const image_type &img, const std::vector<dlib::rectangle> &rects, unsigned long begin, unsigned long end,
+                     unsigned long first_level, unsigned long num_levels, const dlib::matrix<float,0,1> *start_shapes,
+                     std::vector<dlib::full_object_detection> &shapes) const {
+            if (layout_.header.flags & MODEL_FLAG_PACKED_SPLITS) {
+                std::vector<uint8> feature_pixel_values((end - begin) * layout_.header.feature_pool_size);
+                predict(img, rects, begin, end, first_level, num_levels, start_shapes, feature_pixel_values, shapes);
+            } else {
+                std::vector<float> feature_pixel_values((end - begin) * layout_.header.feature_pool_size);
+                predict(img, rects, begin, end, first_level, num_levels, start_shapes, feature_pixel_values, shapes);
+            }
+        }
+        
+        /**
+         *  shapes of the faces rects[begin, end) after the levels [first_level, num_levels),
+         *  starting from start_shapes[begin, end) or the mean shape if NULL, with
+         *  feature_pixel_values holding the feature pool of every one of them
+         */
+        template <typename image_type, typename feature_type>
+        void predict(const image_type &img, const std::vector<dlib::rectangle> &rects, unsigned long begin, unsigned long end,
+                     unsigned long first_level, unsigned long num_levels, const dlib::matrix<float,0,1> *start_shapes,
+                     std::vector<feature_type> &feature_pixel_values, std::vector<dlib::full_object_detection> &shapes) const {
+            const model_header &header = layout_.header;
+            const uint64 leaf_value_num = header.leaf_value_num();
+            const unsigned long num_faces = end - begin;
+            
+            std::vector<dlib::matrix<float,0,1> > current_shapes(num_faces, initial_shape_);
+            if (start_shapes) std::copy(start_shapes + begin, start_shapes + end, current_shapes.begin());
+            std::vector<float> feature_points(2 * header.feature_pool_size);
+            std::vector<int32> acc(num_faces * leaf_value_num);
+            std::vector<double> level_ms;
+            if (stats_.load(std::memory_order_acquire)) level_ms.assign(header.cascade_depth, 0);
+            for (unsigned long level = first_level; level < num_levels; ++ level) {
+                ensure_level(level);
+                const std::chrono::steady_clock::time_point level_start = std::chrono::steady_clock::now();
+                for (unsigned long face = 0; face < num_faces; ++ face) {
+                    extract_feature_pixel_values(img, rects[begin + face], current_shapes[face], level, &feature_points[0],
+                                                 &feature_pixel_values[face * header.feature_pool_size]);
+                }
+                
+                std::fill(acc.begin(), acc.end(), 0);
+                const level_leaves &leaves = leaves_[level];
+                const feature_type *features = &feature_pixel_values[0];
+                switch (header.tree_depth) {
+                    case 3: accumulate_level<3>(leaves, features, num_faces, &acc[0]); break;
+                    case 4: accumulate_level<4>(leaves, features, num_faces, &acc[0]); break;
+                    case 5: accumulate_level<5>(leaves, features, num_faces, &acc[0]); break;
+                    case 6: accumulate_level<6>(leaves, features, num_faces, &acc[0]); break;
+                    default: accumulate_level<0>(leaves, features, num_faces, &acc[0]); break;
+                }
+                const std::vector<float32> &precision = level_code_table(code_tables_, level).quantization_precision;
+                for (unsigned long face = 0; face < num_faces; ++ face) {
+                    dlib::matrix<float,0,1> &current_shape = current_shapes[face];
+                    const int32 *face_acc = &acc[face * leaf_value_num];
+                    for (unsigned long idx = 0; idx < leaf_value_num; ++ idx) {
+                        current_shape(idx) += face_acc[idx] * precision[idx];
+                    }
+                }
+                if (!level_ms.empty()) {
+                    level_ms[level] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - level_start).count();
+                }
+            }
+            if (!level_ms.empty()) {
+                std::lock_guard<std::mutex> lock(stats_mutex_);
+                if (model_stats *stats = stats_.load(std::memory_order_relaxed)) {
+                    for (unsigned long level = 0; level < level_ms.size(); ++ level) stats->level_ms[level] += level_ms[level];
+                    stats->faces += num_faces;
+                }
+            }
+            
+            for (unsigned long face = 0; face < num_faces; ++ face) {
+                const dlib::rectangle &rect = rects[begin + face];
+                const dlib::point_transform_affine tform_to_img = dlib::impl::unnormalizing_tform(rect);
+                std::vector<dlib::point> parts(header.landmark_num);
+                for (unsigned long idx = 0; idx < parts.size(); ++ idx) {
+                    parts[idx] = tform_to_img(dlib::impl::location(current_shapes[face], idx));
+                }
+                shapes[begin + face] = dlib::full_object_detection(rect, parts);
+            }
+        }
+        
+        /**
+         *  splits and leaves of one cascade level, the leaves either dense or sparse, in arena_
+         */
+        struct level_leaves {
+            level_leaves() : splits(NULL), rows(NULL), code_width(0), codes(NULL), offsets(NULL), indices(NULL), values(NULL) {}
+            const char *splits;             // num_trees * num_splits splits in the format of the splits section
+            const uint16 *rows;             // codebook: row of every tree leaf, NULL if the leaves are not a codebook
+            unsigned int code_width;        // bytes per dense quantization code: 1, 2 or 4, 0 if sparse
+            const char *codes;              // dense: num_trees * num_leaves * leaf_value_num codes
+            const uint32 *offsets;          // sparse: leaf i owns entries [offsets[i], offsets[i + 1])
+            const uint16 *indices;          // sparse: coordinate of every non-zero code
+            const int16 *values;            // sparse: the non-zero codes
+        };
+        
+        // a level is stored sparse if at most 1 / sparse_ratio of its codes are non-zero
+        static const unsigned long sparse_ratio = 8;
+        
+        static void sparsify_codes(const std::vector<int32> &codes, unsigned long leaf_value_num, uint64 non_zero,
+                                   aligned_arena &arena, level_leaves &leaves) {
+            uint32 *offsets = arena.allocate<uint32>(codes.size() / leaf_value_num + 1);
+            uint16 *indices = arena.allocate<uint16>(non_zero);
+            int16 *values = arena.allocate<int16>(non_zero);
+            uint32 num = 0;
+            for (size_t idx = 0; idx < codes.size(); ++ idx) {
+                if (idx % leaf_value_num == 0) offsets[idx / leaf_value_num] = num;
+                if (codes[idx] == 0) continue;
+                indices[num] = static_cast<uint16>(idx % leaf_value_num);
+                values[num] = static_cast<int16>(codes[idx]);
+                ++ num;
+            }
+            offsets[codes.size() / leaf_value_num] = num;
+            leaves.code_width = 0;
+            leaves.offsets = offsets;
+            leaves.indices = indices;
+            leaves.values = values;
+        }
+        
+        template <typename T>
+        static void narrow_codes(const std::vector<int32> &codes, aligned_arena &arena, level_leaves &leaves) {
+            T *out = arena.allocate<T>(codes.size());
+            for (size_t idx = 0; idx < codes.size(); ++ idx) out[idx] = static_cast<T>(codes[idx]);
+            leaves.code_width = sizeof(T);
+            leaves.codes = reinterpret_cast<const char *>(out);
+        }
+        
+        /**
+         *  an indexed leaf stream is decoded from the start of the level. Without an
+         *  index the stream is one continuous Huffman stream, so decoding a level also
+         *  decodes every level before it that has not been decoded yet.
+         */
+        void ensure_level(unsigned long level) const {
+            if (level_ready_[level].load(std::memory_order_acquire)) return;
+            
+            std::lock_guard<std::mutex> lock(mutex_);
+            while (!level_ready_[level].load(std::memory_order_relaxed)) {
+                decode_level(layout_.index_block_trees ? level : decoded_levels_);
+            }
+        }
+        
+        void decode_level(unsigned long level) const {
+            const model_header &header = layout_.header;
+            const uint64 leaf_value_num = header.leaf_value_num();
+            const uint64 values_per_level = layout_.level_vector_num() * leaf_value_num;
+            stage_recorder recorder(stats_.load(std::memory_order_acquire));
+            std::vector<int32> &codes = decode_codes_;
+            codes.resize(values_per_level);
+            const leaf_code_table &table = level_code_table(code_tables_, level);
+            bit_reader reader(layout_.leaf_values.data, layout_.leaf_values.size, level_bit_offset_[level]);
+            const uint64 values_per_tree = header.num_leaves() * leaf_value_num;
+            uint32 state = 0;
+            for (uint64 idx = 0; idx < values_per_level; idx += leaf_value_num) {
+                // the blocks of an index follow each other in the stream, but a tANS stream
+                // restarts at every block
+                const uint64 tree = idx / values_per_tree;
+                if (idx % values_per_tree == 0 && (tree == 0 || (layout_.index_block_trees && tree % layout_.index_block_trees == 0))) {
+                    state = start_leaf_block(table, reader);
+                }
+                decode_leaf_codes(table, reader, state, &codes[idx], leaf_value_num);
+            }
+            int32 min_code = 0, max_code = 0;
+            uint64 non_zero = 0;
+            for (uint64 idx = 0; idx < values_per_level; ++ idx) {
+                min_code = std::min(min_code, codes[idx]);
+                max_code = std::max(max_code, codes[idx]);
+                non_zero += codes[idx] != 0;
+            }
+            if (!layout_.index_block_trees) {
+                level_bit_offset_[level + 1] = reader.tell();
+                ++ decoded_levels_;
+            }
+            const uint64 level_bits = reader.tell() - level_bit_offset_[level];
+            
+            level_leaves &leaves = leaves_[level];
+            const bool fits_int16 = min_code >= std::numeric_limits<int16>::min() && max_code <= std::numeric_limits<int16>::max();
+            unsigned int code_width = sizeof(int32);
+            if (fits_int16 && leaf_value_num <= 65536 && non_zero * sparse_ratio <= values_per_level) {
+                code_width = 0;
+            } else if (min_code >= std::numeric_limits<signed char>::min() && max_code <= std::numeric_limits<signed char>::max()) {
+                code_width = sizeof(signed char);
+            } else if (fits_int16) {
+                code_width = sizeof(int16);
+            }
+            
+            // the splits of the level, the codebook rows of its tree leaves and its leaves
+            // right after them
+            const uint64 split_bytes = header.num_trees_per_cascade_level * header.num_splits() * header.split_size();
+            const uint64 row_num = layout_.codebook_size ? header.num_trees_per_cascade_level * header.num_leaves() : 0;
+            uint64 leaf_bytes = aligned_arena::allocation_size<char>(values_per_level * code_width);
+            if (code_width == 0) {
+                leaf_bytes = aligned_arena::allocation_size<uint32>(values_per_level / leaf_value_num + 1) +
+                             aligned_arena::allocation_size<uint16>(non_zero) + aligned_arena::allocation_size<int16>(non_zero);
+            }
+            arena_.reserve(aligned_arena::allocation_size<char>(split_bytes) + aligned_arena::allocation_size<uint16>(row_num) + leaf_bytes);
+            char *splits = arena_.allocate<char>(split_bytes);
+            std::memcpy(splits, splits_ + level * split_bytes, split_bytes);
+            leaves.splits = splits;
+            if (row_num) {
+                uint16 *rows = arena_.allocate<uint16>(row_num);
+                for (uint64 idx = 0; idx < row_num; ++ idx) rows[idx] = static_cast<uint16>(leaf_rows_[level * row_num + idx]);
+                leaves.rows = rows;
+            }
+            
+            switch (code_width) {
+                case 0: sparsify_codes(codes, leaf_value_num, non_zero, arena_, leaves); break;
+                case 1: narrow_codes<signed char>(codes, arena_, leaves); break;
+                case 2: narrow_codes<int16>(codes, arena_, leaves); break;
+                default: narrow_codes<int32>(codes, arena_, leaves); break;
+            }
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex_);
+                recorder.record("leaf_values[" + std::to_string(level) + "]", (level_bits + 7) / 8);
+            }
+            level_ready_[level].store(true, std::memory_order_release);
+            unsigned long ready = ready_levels_.load(std::memory_order_relaxed);
+            while (ready < header.cascade_depth && level_ready_[ready].load(std::memory_order_relaxed)) ++ ready;
+            ready_levels_.store(ready, std::memory_order_release);
+        }
+        
+        /**
+         *  feature pool of one face at a level, with feature_points as room for the
+         *  2 * feature_pool_size coordinates of the pool
+         */
+        template <typename image_type, typename feature_type>
+        void extract_feature_pixel_values(const image_type &img_, const dlib::rectangle &rect,
+                                          const dlib::matrix<float,0,1> &current_shape, unsigned long level,
+                                          float *feature_points, feature_type *feature_pixel_values) const {
+            const unsigned long pool_size = layout_.header.feature_pool_size;
+            const dlib::point_transform_affine tform = dlib::impl::find_tform_between_shapes(initial_shape_, current_shape);
+            float *x = feature_points, *y = feature_points + pool_size;
+            const uint64 offset = level * pool_size;
+            transform_feature_offsets(pool_dx_ + offset, pool_dy_ + offset, pool_anchor_ + offset, &current_shape(0),
+                                      static_cast<float>(tform.get_m()(0, 0)), static_cast<float>(tform.get_m()(0, 1)),
+                                      static_cast<float>(tform.get_m()(1, 0)), static_cast<float>(tform.get_m()(1, 1)),
+                                      pool_size, x, y);
+            
+            // to image coordinates. dlib::point rounds p to floor(p + 0.5), and for p + 0.5
+            // in [0, size) that is the truncation, so the bounds are checked before rounding.
+            const dlib::point_transform_affine tform_to_img = dlib::impl::unnormalizing_tform(rect);
+            const double a00 = tform_to_img.get_m()(0, 0), a01 = tform_to_img.get_m()(0, 1), b0 = tform_to_img.get_b().x();
+            const double a10 = tform_to_img.get_m()(1, 0), a11 = tform_to_img.get_m()(1, 1), b1 = tform_to_img.get_b().y();
+            const double nr = static_cast<double>(dlib::num_rows(img_)), nc = static_cast<double>(dlib::num_columns(img_));
+            dlib::const_image_view<image_type> img(img_);
+            for (unsigned long idx = 0; idx < pool_size; ++ idx) {
+                const double px = a00 * x[idx] + a01 * y[idx] + b0 + 0.5;
+                const double py = a10 * x[idx] + a11 * y[idx] + b1 + 0.5;
+                if (px >= 0 && py >= 0 && px < nc && py < nr) {
+                    set_feature_pixel_value(feature_pixel_values[idx], dlib::get_pixel_intensity(img[static_cast<long>(py)][static_cast<long>(px)]));
+                } else {
+                    feature_pixel_values[idx] = 0;
+                }
+            }
+        }
+        
+        /**
+         *  adds the leaves of every tree of a level for num_faces faces, whose feature
+         *  pools and accumulators follow each other in feature_pixel_values and acc.
+         *  depth is the tree depth, or 0 to read it from the header.
+         */
+        template <unsigned long depth, typename feature_type>
+        void accumulate_level(const level_leaves &leaves, const feature_type *feature_pixel_values,
+                              unsigned long num_faces, int32 *acc) const {
+            switch (leaves.code_width) {
+                case 0: accumulate_forest_sparse<depth>(leaves, feature_pixel_values, num_faces, acc); break;
+                case 1: accumulate_forest<depth>(leaves, reinterpret_cast<const signed char *>(leaves.codes), feature_pixel_values, num_faces, acc); break;
+                case 2: accumulate_forest<depth>(leaves, reinterpret_cast<const int16 *>(leaves.codes), feature_pixel_values, num_faces, acc); break;
+                default: accumulate_forest<depth>(leaves, reinterpret_cast<const int32 *>(leaves.codes), feature_pixel_values, num_faces, acc); break;
+            }
+        }
+        
+        template <unsigned long depth, typename T, typename feature_type>
+        void accumulate_forest(const level_leaves &leaves, const T *codes, const feature_type *feature_pixel_values,
+                               unsigned long num_faces, int32 *acc) const {
+            const model_header &header = layout_.header;
+            const uint64 leaf_value_num = header.leaf_value_num();
+            const uint64 tree_split_bytes = header.num_splits() * header.split_size();
+            for (unsigned long tree = 0; tree < header.num_trees_per_cascade_level; ++ tree) {
+                const char *splits = leaves.splits + tree * tree_split_bytes;
+                for (unsigned long face = 0; face < num_faces; ++ face) {
+                    unsigned long leaf = tree * header.num_leaves() + find_leaf<depth>(splits, feature_pixel_values + face * header.feature_pool_size);
+                    if (leaves.rows) leaf = leaves.rows[leaf];
+                    accumulate_codes(codes + leaf * leaf_value_num, acc + face * leaf_value_num, leaf_value_num);
+                }
+            }
+        }
+        
+        template <unsigned long depth, typename feature_type>
+        void accumulate_forest_sparse(const level_leaves &leaves, const feature_type *feature_pixel_values,
+                                      unsigned long num_faces, int32 *acc) const {
+            const model_header &header = layout_.header;
+            const uint64 leaf_value_num = header.leaf_value_num();
+            const uint64 tree_split_bytes = header.num_splits() * header.split_size();
+            for (unsigned long tree = 0; tree < header.num_trees_per_cascade_level; ++ tree) {
+                const char *splits = leaves.splits + tree * tree_split_bytes;
+                for (unsigned long face = 0; face < num_faces; ++ face) {
+                    unsigned long leaf = tree * header.num_leaves() + find_leaf<depth>(splits, feature_pixel_values + face * header.feature_pool_size);
+                    if (leaves.rows) leaf = leaves.rows[leaf];
+                    accumulate_sparse_codes(leaves.indices, leaves.values, leaves.offsets[leaf], leaves.offsets[leaf + 1],
+                                            acc + face * leaf_value_num);
+                }
+            }
+        }
+        
+        /**
+         *  whether split idx of a tree sends the features to its left child 2 * idx + 1
+         */
+        static inline bool split_left(const char *splits, unsigned long idx, const float *feature_pixel_values) {
+            const char *split = splits + idx * 8;
+            const float diff = feature_pixel_values[load_value<uint16>(split)] - feature_pixel_values[load_value<uint16>(split + 2)];
+            return diff > load_value<float32>(split + 4);
+        }
+        
+        static inline bool split_left(const char *splits, unsigned long idx, const uint8 *feature_pixel_values) {
+            const uint32 split = load_value<uint32>(splits + idx * sizeof(uint32));
+            const int32 diff = static_cast<int32>(feature_pixel_values[packed_split_idx1(split)]) -
+                               static_cast<int32>(feature_pixel_values[packed_split_idx2(split)]);
+            return diff > packed_split_thresh(split);
+        }
+        
+        /**
+         *  leaf of a tree reached by the features, with a fixed number of steps for a
+         *  depth known at compile time
+         */
+        template <unsigned long depth, typename feature_type>
+        unsigned long find_leaf(const char *splits, const feature_type *feature_pixel_values) const {
+            if (depth == 0) return find_leaf(splits, layout_.header.num_splits(), feature_pixel_values);
+            unsigned long idx = 0;
+            for (unsigned long step = 0; step < depth; ++ step) {
+                idx = split_left(splits, idx, feature_pixel_values) ? 2 * idx + 1 : 2 * idx + 2;
+            }
+            return idx - ((1ul << depth) - 1);
+        }
+        
+        template <typename feature_type>
+        static unsigned long find_leaf(const char *splits, uint64 split_num, const feature_type *feature_pixel_values) {
+            unsigned long idx = 0;
+            while (idx < split_num) {
+                idx = split_left(splits, idx, feature_pixel_values) ? 2 * idx + 1 : 2 * idx + 2;
+            }
+            return idx - split_num;
+        }
+        
+        mapped_file file_;
+        model_layout layout_;
+        dlib::matrix<float,0,1> initial_shape_;
+        std::vector<leaf_code_table> code_tables_;
+        // the splits section, or the packed splits decoded from coded splits, which
+        // decode_level copies into the arena
+        const char *splits_;
+        std::vector<uint32> split_buffer_;
+        // codebook row of every tree leaf, which decode_level copies into the arena
+        std::vector<uint32> leaf_rows_;
+        const float *pool_dx_;
+        const float *pool_dy_;
+        const uint32 *pool_anchor_;
+        std::atomic<unsigned long> max_levels_;
+        
+        mutable std::mutex mutex_;
+        mutable aligned_arena arena_;
+        mutable std::vector<level_leaves> leaves_;
+        mutable std::vector<int32> decode_codes_;       // decoding buffer reused by every level
+        mutable std::unique_ptr<std::atomic<bool>[]> level_ready_;
+        mutable std::vector<uint64> level_bit_offset_;
+        mutable unsigned long decoded_levels_;
+        mutable std::atomic<unsigned long> ready_levels_;
+        
+        std::atomic<bool> progressive_;
+        std::thread background_;
+        std::atomic<bool> stop_background_;
+        
+        mutable std::mutex stats_mutex_;
+        std::atomic<model_stats *> stats_;
+    };
+    
+}
+
+#endif /* compressed_shape_predictor_h */
@@ -0,0 +1,115 @@
+//
+//  embed_model.cpp
+//  dlib_utils
+//
+//  Created by zhaoyu on 2018/1/8.
+//  Copyright © 2018 zhaoyu. All rights reserved.
+//
+
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cctype>
+#include <utility>
+
+#include <model_utils.hpp>
+
+/**
+ *  whether name can be used as a C++ identifier
+ */
+bool is_identifier(const std::string &name) {
+    if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0]))) return false;
+    for (char c: name) {
+        if (c != '_' && !std::isalnum(static_cast<unsigned char>(c))) return false;
+    }
+    return true;
+}
+
+/**
+ *  turn a compressed model into a C++ header with the model image as a const byte
+ *  array, which the linker places in read-only pages, and the header fields and
+ *  section offsets of the model as constants. The header declares the array; it is
+ *  defined in the one source file that defines NAME_IMPLEMENTATION (the array name in
+ *  upper case) before including it, so the program holds a single copy:
+ *
+ *      #define FACE_MODEL_IMPLEMENTATION
+ *      #include "face_model.hpp"
+ *
+ *  Load it without any file I/O:
+ *
+ *      #include "face_model.hpp"
+ *      med::load_shape_predictor_model(sp, face_model, face_model_size);
+ *      med::compressed_shape_predictor csp(face_model, face_model_size);
+ */
+int main(int argc, const char * argv[]) {
+    
+    if (argc < 3) {
+        std::cout << "Usage: ./embed_model.bin compressed_model_path header_path [array_name]" << std::endl;
+        return 0;
+    }
+    
+    const std::string name = argc > 3 ? argv[3] : "compressed_model";
+    if (!is_identifier(name)) {
+        std::cout << "The array name " << name << " is not a C++ identifier." << std::endl;
+        return 1;
+    }
+    std::string guard = name;
+    for (auto &c: guard) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    
+    // the model is parsed first, so that a broken model fails here and not at startup
+    med::mapped_file file(argv[1]);
+    std::vector<med::byte_view> sections = med::split_sections(file.data(), file.size());
+    med::model_layout layout;
+    med::parse_model_layout(sections, layout);
+    const med::model_header &header = layout.header;
+    
+    std::ofstream os(argv[2]);
+    if (!os) {
+        std::cout << "Unable to open " << argv[2] << " for writing." << std::endl;
+        return 1;
+    }
+    
+    os << "//\n//  generated by embed_model.cpp from " << argv[1] << ", do not edit\n//\n\n";
+    os << "#ifndef " << name << "_h\n#define " << name << "_h\n\n";
+    os << "// header of the model\n";
+    const std::pair<const char *, unsigned long long> fields[] = {
+        {"version", header.version}, {"flags", header.flags}, {"cascade_depth", header.cascade_depth},
+        {"num_trees_per_cascade_level", header.num_trees_per_cascade_level}, {"tree_depth", header.tree_depth},
+        {"feature_pool_size", header.feature_pool_size}, {"landmark_num", header.landmark_num}
+    };
+    for (auto &field: fields) {
+        os << "const unsigned long long " << name << "_" << field.first << " = " << field.second << "ull;\n";
+    }
+    os << "\n// the model image and the byte offset and size of every section in it, defined where\n"
+       << "// " << guard << "_IMPLEMENTATION is defined\n";
+    os << "const unsigned long long " << name << "_size = " << file.size() << "ull;\n";
+    os << "const unsigned long long " << name << "_section_num = " << sections.size() << "ull;\n";
+    const med::uint64 array_size = std::max<med::uint64>(file.size(), 1);
+    const med::uint64 section_array_size = std::max<med::uint64>(sections.size(), 1);
+    os << "extern const unsigned long long " << name << "_section_offsets[" << section_array_size << "];\n";
+    os << "extern const unsigned long long " << name << "_section_sizes[" << section_array_size << "];\n";
+    os << "extern const unsigned char " << name << "[" << array_size << "];\n\n";
+    
+    os << "#ifdef " << guard << "_IMPLEMENTATION\n";
+    os << "const unsigned long long " << name << "_section_offsets[" << section_array_size << "] = {";
+    for (unsigned long idx = 0; idx < sections.size(); ++ idx) {
+        os << (idx ? ", " : "") << sections[idx].data - file.data() << "ull";
+    }
+    os << "};\n";
+    os << "const unsigned long long " << name << "_section_sizes[" << section_array_size << "] = {";
+    for (unsigned long idx = 0; idx < sections.size(); ++ idx) {
+        os << (idx ? ", " : "") << sections[idx].size << "ull";
+    }
+    os << "};\n";
+    os << "const unsigned char " << name << "[" << array_size << "] = {";
+    
+    char hex[8];
+    for (med::uint64 idx = 0; idx < file.size(); ++ idx) {
+        if (idx % 16 == 0) os << "\n    ";
+        std::snprintf(hex, sizeof(hex), "0x%02x,", static_cast<unsigned int>(static_cast<med::uint8>(file.data()[idx])));
+        os << hex;
+    }
+    os << "\n};\n#endif /* " << guard << "_IMPLEMENTATION */\n\n#endif /* " << name << "_h */\n";
+    
+    return os ? 0 : 1;
+}
@@ -0,0 +1,373 @@
+//
+//  eval_utils.hpp
+//  dlib_utils
+//
+//  Created by zhaoyu on 2018/1/8.
+//  Copyright © 2018 zhaoyu. All rights reserved.
+//
+
+#ifndef eval_utils_h
+#define eval_utils_h
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <thread>
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+#include <dlib/image_processing.h>
+#include <dlib/image_processing/frontal_face_detector.h>
+#include <dlib/image_io.h>
+#include <dlib/dir_nav.h>
+#include <model_utils.hpp>
+
+
+namespace med {
+    
+    /**
+     *  an image and the face rectangles to run the predictors on
+     */
+    struct eval_sample {
+        dlib::matrix<unsigned char> img;
+        std::vector<dlib::rectangle> faces;
+    };
+    
+    /**
+     *  synthetic grayscale images: a smooth background, a bright ellipse with darker
+     *  blobs for every face, and pixel noise. They have no real faces in them, but the
+     *  predictors see textured input, which is all that is needed to compare a
+     *  compressed predictor against the original one.
+     */
+    void make_synthetic_samples(std::vector<eval_sample> &samples, unsigned long num,
+                                unsigned long width=320, unsigned long height=240, unsigned long seed=0) {
+        std::mt19937 rng(static_cast<unsigned int>(seed));
+        std::uniform_real_distribution<double> uniform(0, 1);
+        std::normal_distribution<double> noise(0, 8);
+        
+        samples.resize(num);
+        for (unsigned long n = 0; n < num; ++ n) {
+            eval_sample &sample = samples[n];
+            sample.faces.clear();
+            
+            const unsigned long face_num = 1 + n % 3;
+            for (unsigned long f = 0; f < face_num; ++ f) {
+                long size = static_cast<long>(std::min(width, height) * (0.3 + 0.2 * uniform(rng)));
+                long left = static_cast<long>((width - size) * uniform(rng));
+                long top = static_cast<long>((height - size) * uniform(rng));
+                sample.faces.push_back(dlib::rectangle(left, top, left + size - 1, top + size - 1));
+            }
+            
+            const double gx = uniform(rng) - 0.5, gy = uniform(rng) - 0.5, base = 60 + 60 * uniform(rng);
+            sample.img.set_size(height, width);
+            for (long r = 0; r < static_cast<long>(height); ++ r) {
+                for (long c = 0; c < static_cast<long>(width); ++ c) {
+                    double v = base + 80 * (gx * c / width + gy * r / height);
+                    for (auto &face: sample.faces) {
+                        const dlib::point center = face.center();
+                        const double dx = (c - center.x()) / (0.5 * face.width());
+                        const double dy = (r - center.y()) / (0.6 * face.height());
+                        if (dx * dx + dy * dy < 1) v += 70;
+                        // eyes and mouth
+                        const double ex = std::fabs(dx) - 0.4, ey = dy + 0.25, my = dy - 0.45;
+                        if (ex * ex + ey * ey < 0.02 || (std::fabs(dx) < 0.35 && my * my < 0.005)) v -= 90;
+                    }
+                    v += noise(rng);
+                    sample.img(r, c) = static_cast<unsigned char>(std::max(0.0, std::min(255.0, v)));
+                }
+            }
+        }
+    }
+    
+    /**
+     *  every image in dir that dlib can load, with the faces found by dlib's frontal
+     *  face detector. Images without a detection use a centered square instead.
+     */
+    void load_image_samples(const std::string &dir, std::vector<eval_sample> &samples) {
+        dlib::frontal_face_detector detector = dlib::get_frontal_face_detector();
+        std::vector<dlib::file> files = dlib::directory(dir).get_files();
+        std::sort(files.begin(), files.end());
+        
+        samples.clear();
+        for (auto &file: files) {
+            eval_sample sample;
+            try {
+                dlib::load_image(sample.img, file.full_name());
+            } catch (std::exception &) {
+                continue;
+            }
+            sample.faces = detector(sample.img);
+            if (sample.faces.empty()) {
+                long size = std::min(sample.img.nr(), sample.img.nc()) / 2;
+                long left = (sample.img.nc() - size) / 2, top = (sample.img.nr() - size) / 2;
+                sample.faces.push_back(dlib::rectangle(left, top, left + size - 1, top + size - 1));
+            }
+            samples.push_back(sample);
+        }
+    }
+    
+    /**
+     *  landmark deviation of a predictor against a reference predictor, in pixels
+     *  and relative to the face width
+     */
+    struct deviation_stats {
+        double mean;
+        double max;
+        double mean_relative;
+        double max_relative;
+        unsigned long num_points;
+    };
+    
+    template <typename reference_type, typename predictor_type>
+    deviation_stats landmark_deviation(const reference_type &reference, const predictor_type &predictor,
+                                       const std::vector<eval_sample> &samples) {
+        deviation_stats stats = {0, 0, 0, 0, 0};
+        for (auto &sample: samples) {
+            for (auto &face: sample.faces) {
+                dlib::full_object_detection a = reference(sample.img, face);
+                dlib::full_object_detection b = predictor(sample.img, face);
+                for (unsigned long idx = 0; idx < a.num_parts(); ++ idx) {
+                    const double d = (a.part(idx) - b.part(idx)).length();
+                    const double rel = d / face.width();
+                    stats.mean += d;
+                    stats.mean_relative += rel;
+                    stats.max = std::max(stats.max, d);
+                    stats.max_relative = std::max(stats.max_relative, rel);
+                    ++ stats.num_points;
+                }
+            }
+        }
+        if (stats.num_points) {
+            stats.mean /= stats.num_points;
+            stats.mean_relative /= stats.num_points;
+        }
+        return stats;
+    }
+    
+    /**
+     *  wall time in microseconds per face, averaged over `rounds` passes over samples
+     */
+    template <typename predictor_type>
+    double time_per_face_us(const predictor_type &predictor, const std::vector<eval_sample> &samples, unsigned long rounds=3) {
+        unsigned long faces = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned long n = 0; n < rounds; ++ n) {
+            for (auto &sample: samples) {
+                for (auto &face: sample.faces) {
+                    dlib::full_object_detection shape = predictor(sample.img, face);
+                    faces += shape.num_parts() ? 1 : 0;
+                }
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        return faces ? std::chrono::duration<double, std::micro>(end - start).count() / faces : 0;
+    }
+    
+    /**
+     *  same as time_per_face_us, with all faces of an image predicted in one batch
+     *  call spread over pool
+     */
+    template <typename predictor_type>
+    double batch_time_per_face_us(const predictor_type &predictor, const std::vector<eval_sample> &samples,
+                                  dlib::thread_pool &pool, unsigned long rounds=3) {
+        unsigned long faces = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned long n = 0; n < rounds; ++ n) {
+            for (auto &sample: samples) {
+                std::vector<dlib::full_object_detection> shapes = predictor(sample.img, sample.faces, pool);
+                faces += shapes.size();
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        return faces ? std::chrono::duration<double, std::micro>(end - start).count() / faces : 0;
+    }
+    
+    class stopwatch {
+    public:
+        stopwatch() : start_(std::chrono::steady_clock::now()) {}
+        void reset() { start_ = std::chrono::steady_clock::now(); }
+        double elapsed_ms() const {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_).count();
+        }
+    private:
+        std::chrono::steady_clock::time_point start_;
+    };
+    
+    /**
+     *  peak resident memory of the process. On Linux the peak can be reset, so it
+     *  measures one step at a time; elsewhere it is the peak since process start.
+     */
+    bool reset_peak_memory() {
+        std::ofstream os("/proc/self/clear_refs");
+        if (!os) return false;
+        os << "5";
+        return static_cast<bool>(os);
+    }
+    
+    uint64 proc_status_kb(const std::string &key) {
+        std::ifstream is("/proc/self/status");
+        std::string line;
+        while (std::getline(is, line)) {
+            if (line.compare(0, key.size(), key) == 0) {
+                std::istringstream ss(line.substr(key.size() + 1));
+                uint64 kb = 0;
+                ss >> kb;
+                return kb;
+            }
+        }
+        return 0;
+    }
+    
+    uint64 current_memory_bytes() {
+        return proc_status_kb("VmRSS") * 1024;
+    }
+    
+    uint64 peak_memory_bytes() {
+        uint64 kb = proc_status_kb("VmHWM");
+        if (kb) return kb * 1024;
+#if !defined(_WIN32)
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(__APPLE__)
+            return static_cast<uint64>(usage.ru_maxrss);
+#else
+            return static_cast<uint64>(usage.ru_maxrss) * 1024;
+#endif
+        }
+#endif
+        return 0;
+    }
+    
+    uint64 file_size(const std::string &path) {
+        std::ifstream is(path, std::ifstream::binary | std::ifstream::ate);
+        return is ? static_cast<uint64>(is.tellg()) : 0;
+    }
+    
+    /**
+     *  "model", "level" or "coordinate" -> quantizer_type
+     */
+    quantizer_type parse_quantizer(const std::string &name) {
+        if (name == "level") return QUANTIZER_LEVEL;
+        if (name == "coordinate") return QUANTIZER_COORDINATE;
+        if (name == "model") return QUANTIZER_MODEL;
+        throw dlib::error("Unknown quantizer: " + name);
+    }
+    
+    /**
+     *  largest landmark deviation a compressed model may have against the original
+     *  one. Every limit defaults to none.
+     */
+    struct error_budget {
+        error_budget() :
+        mean(std::numeric_limits<double>::infinity()), max(std::numeric_limits<double>::infinity()),
+        mean_relative(std::numeric_limits<double>::infinity()), max_relative(std::numeric_limits<double>::infinity()) {}
+        
+        double mean;
+        double max;
+        double mean_relative;
+        double max_relative;
+        
+        bool accepts(const deviation_stats &deviation) const {
+            return deviation.mean <= mean && deviation.max <= max &&
+                deviation.mean_relative <= mean_relative && deviation.max_relative <= max_relative;
+        }
+    };
+    
+    /**
+     *  one set of compression options with the size and deviation of the model it
+     *  produces
+     */
+    struct tuning_candidate {
+        compression_options options;
+        uint64 size;
+        deviation_stats deviation;
+        bool accepted;
+    };
+    
+    /**
+     *  compresses sp with every combination of prune threshold, quantization number
+     *  and quantizer, on num_threads threads (0 for one per core), and scores every
+     *  model by its landmark deviation from sp on samples. The other fields of
+     *  options are shared by all candidates.
+     *
+     *  Returns the index in candidates of the smallest model within budget, or -1 if
+     *  there is none; best_model holds its bytes.
+     */
+    long tune_compression(const dlib::shape_predictor &sp, const std::vector<eval_sample> &samples,
+                          const std::vector<float> &prune_list, const std::vector<unsigned long long> &quant_list,
+                          const std::vector<quantizer_type> &quantizer_list, const compression_options &options,
+                          const error_budget &budget, std::vector<tuning_candidate> &candidates,
+                          std::string &best_model, unsigned long num_threads=0) {
+        candidates.clear();
+        for (auto prune_thresh: prune_list) {
+            for (auto quantization_num: quant_list) {
+                for (auto quantizer: quantizer_list) {
+                    tuning_candidate candidate;
+                    candidate.options = options;
+                    candidate.options.prune_thresh = prune_thresh;
+                    candidate.options.quantization_num = quantization_num;
+                    candidate.options.quantizer = quantizer;
+                    // the candidates already run in parallel
+                    candidate.options.num_threads = 1;
+                    candidate.size = 0;
+                    candidate.deviation = deviation_stats();
+                    candidate.accepted = false;
+                    candidates.push_back(candidate);
+                }
+            }
+        }
+        
+        if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+        std::mutex mutex;
+        long best = -1;
+        best_model.clear();
+        // the candidates run in parallel, so every one of them decodes on a single thread
+        dlib::parallel_for(num_threads, 0, static_cast<long>(candidates.size()), [&](long idx) {
+            tuning_candidate &candidate = candidates[idx];
+            std::ostringstream os;
+            save_shape_predictor_model(sp, os, candidate.options);
+            const std::string model = os.str();
+            
+            dlib::shape_predictor loaded;
+            load_shape_predictor_model(loaded, reinterpret_cast<const uint8 *>(model.data()), model.size(), 1);
+            candidate.size = model.size();
+            candidate.deviation = landmark_deviation(sp, loaded, samples);
+            candidate.accepted = budget.accepts(candidate.deviation);
+            if (!candidate.accepted) return;
+            
+            std::lock_guard<std::mutex> lock(mutex);
+            // ties go to the earlier candidate, so the result does not depend on the thread timing
+            if (best < 0 || candidate.size < candidates[best].size || (candidate.size == candidates[best].size && idx < best)) {
+                best = idx;
+                best_model = model;
+            }
+        });
+        return best;
+    }
+    
+    /**
+     *  "1,2.5,3" -> {1, 2.5, 3}
+     */
+    template <typename T>
+    std::vector<T> parse_list(const std::string &text) {
+        std::vector<T> values;
+        std::istringstream ss(text);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            std::istringstream is(item);
+            T v;
+            if (is >> v) values.push_back(v);
+        }
+        return values;
+    }
+    
+}
+
+#endif /* eval_utils_h */
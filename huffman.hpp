@@ -10,117 +10,268 @@
 
 #include <vector>
 #include <unordered_map>
+#include <map>
 #include <algorithm>
+#include <iterator>
+#include <stdexcept>
 
 namespace med {
     
-    // A Huffman Tree Node
-    struct HuffmanTree {
-        int c; // character in an alphabet
-        unsigned long cfreq; // frequency of c.
-        struct HuffmanTree *left;
-        struct HuffmanTree *right;
-        HuffmanTree(int c, int cfreq, struct HuffmanTree *left=NULL,
-                    struct HuffmanTree *right=NULL) :
-        c(c), cfreq(cfreq), left(left), right(right) {
-        }
-        ~HuffmanTree() {
-            delete left, delete right;
-        }
-        // Compare two tree nodes
-        class Compare {
-        public:
-            bool operator()(HuffmanTree *a, HuffmanTree *b) {
-                return a->cfreq > b->cfreq;
-            }
-        };
+    typedef std::vector<bool> code_t;
+    typedef std::unordered_map<int, code_t> codetable;
+    
+    // codes are limited to this many bits, or to the fewest bits that can hold
+    // every symbol of larger alphabets
+    const unsigned int HUFFMAN_MAX_CODE_LENGTH = 16;
+    
+    /**
+     * A node of the package-merge lists: a symbol, or a package of two nodes of the
+     * list of the previous length. Nodes live in one pool and refer to each other by
+     * index.
+     */
+    struct PackageNode {
+        unsigned long long weight;
+        int c;                  // symbol, if leaf
+        unsigned long left;     // pool index of the first node of a package
+        unsigned long right;
+        bool leaf;
     };
     
     /**
-     * Builds a Huffman Tree from an input of alphabet C, where C is a vector
-     * of (character, frequency) pairs.
+     * Builds the code lengths of an optimal prefix code with no code longer than
+     * max_length bits by package-merge, where alph is a vector of (character,
+     * frequency) pairs. A single symbol gets a one bit code.
      */
-    HuffmanTree *build_tree(std::vector< std::pair<int, unsigned long> > &alph) {
-        // First build a min-heap
-        // Build leaf nodes first
-        std::priority_queue<HuffmanTree *, std::vector<HuffmanTree *>, HuffmanTree::Compare > alph_heap;
-        for (auto it = alph.begin(); it != alph.end(); ++ it) {
-            HuffmanTree *leaf = new HuffmanTree(it->first, it->second);
-            alph_heap.push(leaf);
+    std::vector< std::pair<int, unsigned int> > build_code_lengths(const std::vector< std::pair<int, unsigned long> > &alph,
+                                                                  unsigned int max_length=HUFFMAN_MAX_CODE_LENGTH) {
+        std::vector< std::pair<int, unsigned int> > lengths;
+        const unsigned long n = alph.size();
+        if (n == 0) return lengths;
+        if (n == 1) {
+            lengths.push_back(std::make_pair(alph[0].first, 1u));
+            return lengths;
         }
+        while ((1ull << max_length) < n) ++ max_length;
         
-        // HuffmanTree algorithm: Merge two lowest weight leaf nodes until
-        // only one node is left (root).
-        HuffmanTree *root = NULL;
-        while (alph_heap.size() > 1) {
-            HuffmanTree *l, *r;
-            l = alph_heap.top();
-            alph_heap.pop();
-            r = alph_heap.top();
-            alph_heap.pop();
-            root = new HuffmanTree(0, l->cfreq + r->cfreq, l, r);
-            alph_heap.push(root);
+        std::vector<PackageNode> pool;
+        pool.reserve(n * (max_length + 1));
+        std::vector<unsigned long> leaves(n);
+        for (unsigned long idx = 0; idx < n; ++ idx) {
+            PackageNode node = {alph[idx].second, alph[idx].first, 0, 0, true};
+            pool.push_back(node);
+            leaves[idx] = idx;
         }
+        std::sort(leaves.begin(), leaves.end(), [&](unsigned long a, unsigned long b) {
+            return pool[a].weight < pool[b].weight || (pool[a].weight == pool[b].weight && pool[a].c < pool[b].c);
+        });
         
-        return root;
+        // list of length l: the leaves merged with the packages of pairs of list l - 1
+        std::vector<unsigned long> list = leaves, packages, merged;
+        for (unsigned int length = 1; length < max_length; ++ length) {
+            packages.clear();
+            for (unsigned long idx = 0; idx + 1 < list.size(); idx += 2) {
+                PackageNode node = {pool[list[idx]].weight + pool[list[idx + 1]].weight, 0, list[idx], list[idx + 1], false};
+                packages.push_back(pool.size());
+                pool.push_back(node);
+            }
+            merged.clear();
+            std::merge(leaves.begin(), leaves.end(), packages.begin(), packages.end(), std::back_inserter(merged),
+                       [&](unsigned long a, unsigned long b) { return pool[a].weight < pool[b].weight; });
+            list.swap(merged);
+        }
+        
+        // the length of a symbol is the number of times it occurs in the first 2n - 2
+        // nodes of the last list
+        std::vector<unsigned int> count(n, 0);
+        std::vector<unsigned long> stack(list.begin(), list.begin() + 2 * (n - 1));
+        while (!stack.empty()) {
+            // the leaves are the first n nodes of the pool, in the order of alph
+            const unsigned long idx = stack.back();
+            const PackageNode &node = pool[idx];
+            stack.pop_back();
+            if (node.leaf) {
+                ++ count[idx];
+                continue;
+            }
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+        }
+        for (unsigned long idx = 0; idx < n; ++ idx) {
+            lengths.push_back(std::make_pair(alph[idx].first, count[idx]));
+        }
+        return lengths;
     }
     
-    void destroy_tree(HuffmanTree *root) {
-        delete root;
+    /**
+     * Makes the canonical code table of the given code lengths: symbols ordered by
+     * (length, symbol) get consecutive codes, so a decoder only needs the lengths.
+     * Symbols of length 0 get no code. Throws std::invalid_argument if the lengths do
+     * not form a prefix code.
+     */
+    codetable build_canonical_codes(std::vector< std::pair<int, unsigned int> > lengths) {
+        codetable m;
+        std::sort(lengths.begin(), lengths.end(), [](const std::pair<int, unsigned int> &a, const std::pair<int, unsigned int> &b) {
+            return a.second < b.second || (a.second == b.second && a.first < b.first);
+        });
+        unsigned long long code = 0;
+        unsigned int length = 0;
+        bool first = true;
+        for (auto &it: lengths) {
+            if (it.second == 0) continue;
+            if (it.second > 32) throw std::invalid_argument("Huffman code longer than 32 bits.");
+            if (!first) ++ code;
+            code <<= it.second - length;
+            length = it.second;
+            first = false;
+            if ((code >> length) != 0) throw std::invalid_argument("Huffman code lengths are not a prefix code.");
+            code_t &bits = m[it.first];
+            for (unsigned int idx = length; idx > 0; -- idx) bits.push_back(((code >> (idx - 1)) & 1) != 0);
+        }
+        return m;
     }
     
-    typedef std::vector<bool> code_t;
-    typedef std::unordered_map<int, code_t> codetable;
     /**
-     * Makes a lookup table (std::unordered_map) of (c -> code) from a HuffmanTree, where
-     * code is an unsigned long representing the binary code.
+     * Builds the length-limited canonical code table of an alphabet of (character,
+     * frequency) pairs.
      */
-    std::unordered_map<int, code_t> build_lookup_table(HuffmanTree *htree) {
-        codetable lookup;
-        std::deque< std::pair<HuffmanTree *, code_t> > q;
+    codetable build_canonical_table(const std::vector< std::pair<int, unsigned long> > &alph,
+                                    unsigned int max_length=HUFFMAN_MAX_CODE_LENGTH) {
+        return build_canonical_codes(build_code_lengths(alph, max_length));
+    }
+    
+    /**
+     * A dense encoding table: the code of symbol c is codes[c - offset], stored
+     * right-aligned with its first bit as the most significant one, and
+     * lengths[c - offset] is its length (0 for symbols without a code).
+     */
+    struct HuffmanEncodeTable {
+        int offset;
+        std::vector<unsigned long long> codes;
+        std::vector<unsigned char> lengths;
         
-        q.push_back(std::make_pair(htree, code_t()));
-        while (!q.empty()) {
-            HuffmanTree *node, *lc, *rc;
-            code_t code;
-            node = q.front().first;
-            code = q.front().second;
-            q.pop_front();
-            lc = node->left;
-            rc = node->right;
-            if (lc) {
-                // HuffmanTree is always full (either no children or two children)
-                // Left child is appended a 0 and right child a 1.
-                code_t code_cp(code);
-                q.push_back(std::make_pair(lc, (code.push_back(0), code)));
-                q.push_back(std::make_pair(rc, (code_cp.push_back(1), code_cp)));
+        inline unsigned long long code(int c) const { return codes[c - offset]; }
+        inline unsigned int length(int c) const { return lengths[c - offset]; }
+    };
+    
+    HuffmanEncodeTable build_encode_table(const codetable &m) {
+        HuffmanEncodeTable table;
+        table.offset = 0;
+        if (m.empty()) return table;
+        
+        int min_c = m.begin()->first, max_c = m.begin()->first;
+        for (auto &it: m) {
+            min_c = std::min(min_c, it.first);
+            max_c = std::max(max_c, it.first);
+        }
+        table.offset = min_c;
+        table.codes.assign(static_cast<unsigned long>(max_c - min_c) + 1, 0);
+        table.lengths.assign(table.codes.size(), 0);
+        for (auto &it: m) {
+            if (it.second.size() > 64) throw std::overflow_error("Huffman code longer than 64 bits.");
+            unsigned long long code = 0;
+            for (bool bit: it.second) code = (code << 1) | bit;
+            table.codes[it.first - min_c] = code;
+            table.lengths[it.first - min_c] = static_cast<unsigned char>(it.second.size());
+        }
+        return table;
+    }
+    
+    /**
+     * A multi-level lookup table for decoding Huffman codes. The root table is
+     * indexed by the next `root_bits` bits of the stream and resolves every code
+     * that fits in it with a single lookup; longer codes continue into sub tables.
+     */
+    struct HuffmanDecodeTable {
+        struct Entry {
+            int value;              // symbol, or start of the sub table if link
+            unsigned char bits;     // code bits consumed, or width of the sub table if link
+            unsigned char link;
+        };
+        std::vector<Entry> entries;
+        unsigned int root_bits;
+    };
+    
+    typedef std::vector< std::pair<int, const code_t *> > code_ref_list;
+    
+    void fill_decode_table(HuffmanDecodeTable &table, unsigned long start, unsigned int width,
+                           unsigned long depth, const code_ref_list &codes, unsigned int max_bits) {
+        std::map<unsigned long, code_ref_list> longer;
+        for (auto &it: codes) {
+            const code_t &code = *it.second;
+            unsigned long len = code.size() - depth;
+            unsigned long prefix = 0;
+            for (unsigned long idx = 0; idx < width && idx < len; ++ idx) {
+                prefix = (prefix << 1) | code[depth + idx];
+            }
+            if (len <= width) {
+                // every index starting with this code decodes to the symbol
+                unsigned long first = prefix << (width - len);
+                unsigned long count = 1ul << (width - len);
+                for (unsigned long idx = 0; idx < count; ++ idx) {
+                    HuffmanDecodeTable::Entry &e = table.entries[start + first + idx];
+                    e.value = it.first;
+                    e.bits = static_cast<unsigned char>(len);
+                    e.link = 0;
+                }
             } else {
-                // Leaf node: contains the character
-                lookup.insert(std::make_pair(node->c, code));
+                longer[prefix].push_back(it);
             }
         }
         
-        return lookup;
+        for (auto &it: longer) {
+            unsigned long sub_len = 0;
+            for (auto &c: it.second) {
+                sub_len = std::max<unsigned long>(sub_len, c.second->size() - depth - width);
+            }
+            unsigned int sub_width = static_cast<unsigned int>(std::min<unsigned long>(sub_len, max_bits));
+            unsigned long sub_start = table.entries.size();
+            table.entries.resize(sub_start + (1ul << sub_width));
+            HuffmanDecodeTable::Entry &e = table.entries[start + it.first];
+            e.value = static_cast<int>(sub_start);
+            e.bits = static_cast<unsigned char>(sub_width);
+            e.link = 1;
+            fill_decode_table(table, sub_start, sub_width, depth + width, it.second, max_bits);
+        }
     }
     
-    HuffmanTree * build_tree_from_lookup_table(const codetable &m) {
-        HuffmanTree *root = new HuffmanTree(0, 0);
+    /**
+     * Builds a HuffmanDecodeTable from a code table. Each level of the table is at
+     * most `max_bits` wide, which keeps the root table small enough to stay in cache.
+     */
+    HuffmanDecodeTable build_decode_table(const codetable &m, unsigned int max_bits=10) {
+        code_ref_list codes;
+        unsigned long max_len = 0;
         for (auto &it: m) {
-            HuffmanTree * t = root;
-            for (int idx = 0; idx < it.second.size(); ++ idx) {
-                if (it.second[idx] == false) {
-                    // left
-                    if (!t->left) t->left = new HuffmanTree(0, 0);
-                    t = t->left;
-                } else {
-                    // right
-                    if (!t->right) t->right = new HuffmanTree(0, 0);
-                    t = t->right;
-                }
+            codes.push_back(std::make_pair(it.first, &it.second));
+            max_len = std::max<unsigned long>(max_len, it.second.size());
+        }
+        
+        HuffmanDecodeTable table;
+        table.root_bits = static_cast<unsigned int>(std::max<unsigned long>(1, std::min<unsigned long>(max_len, max_bits)));
+        HuffmanDecodeTable::Entry empty = {0, 0, 0};
+        table.entries.assign(1ul << table.root_bits, empty);
+        fill_decode_table(table, 0, table.root_bits, 0, codes, max_bits);
+        return table;
+    }
+    
+    /**
+     * Decodes one symbol. BitReader must provide peek(n), returning the next n bits
+     * of the stream without consuming them, and skip(n).
+     */
+    template <typename BitReader>
+    inline int decode_symbol(const HuffmanDecodeTable &table, BitReader &reader) {
+        unsigned long start = 0;
+        unsigned int width = table.root_bits;
+        for (;;) {
+            const HuffmanDecodeTable::Entry &e = table.entries[start + reader.peek(width)];
+            if (!e.link) {
+                reader.skip(e.bits);
+                return e.value;
             }
-            t->c = it.first;
+            reader.skip(width);
+            start = static_cast<unsigned long>(e.value);
+            width = e.bits;
         }
-        return root;
     }
 }
 
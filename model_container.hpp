@@ -0,0 +1,277 @@
+//
+//  model_container.hpp
+//  dlib_utils
+//
+//  Created by zhaoyu on 2018/1/8.
+//  Copyright © 2018 zhaoyu. All rights reserved.
+//
+
+#ifndef model_container_h
+#define model_container_h
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <model_utils.hpp>
+
+
+namespace med {
+    
+    /**
+     *  container of several compressed models in one file
+     *
+     *  uint64 CONTAINER_MAGIC, uint64 container version, uint64 number of models and
+     *  uint64 number of blobs, then (uint64 offset, uint64 size) per blob with the
+     *  offset from the start of the file, then per model the uint64 size of its name,
+     *  the name, the uint64 number of its sections and the blob index of every section.
+     *  The blobs follow, each at a multiple of CONTAINER_ALIGNMENT bytes. A blob holds
+     *  the data of a model section without its length, and sections with the same
+     *  data, such as the code tables, initial shape or splits that fine-tuned variants
+     *  of one model have in common, share one blob.
+     *
+     *  Opening a container reads only the directory. The sections of a model are read
+     *  in place when it is loaded, so a mapped container never touches the pages of
+     *  the models that are not used.
+     */
+    const uint64 CONTAINER_MAGIC = 0x3143444f4d44454dull;      // "MEDMODC1"
+    const uint64 CONTAINER_VERSION = 0;
+    const uint64 CONTAINER_ALIGNMENT = 8;
+    
+    inline bool is_model_container(const char *data, uint64 size) {
+        return size >= sizeof(uint64) && load_value<uint64>(data) == CONTAINER_MAGIC;
+    }
+    
+    /**
+     *  builds a container from compressed model images, as written by
+     *  save_shape_predictor_model
+     */
+    class model_container_writer {
+    public:
+        model_container_writer() : shared_bytes_(0) {}
+        
+        void add(const std::string &name, const char *data, uint64 size) {
+            for (auto &model: models_) {
+                if (model.name == name) throw dlib::error("Duplicate model " + name + " in container.");
+            }
+            // parsed first, so that a broken model fails here and not when it is loaded
+            std::vector<byte_view> sections = split_sections(data, size);
+            model_layout layout;
+            parse_model_layout(sections, layout);
+            
+            model_entry model;
+            model.name = name;
+            for (auto &section: sections) model.blobs.push_back(add_blob(section));
+            models_.push_back(model);
+        }
+        
+        void add(const std::string &name, const std::string &image) {
+            add(name, image.data(), image.size());
+        }
+        
+        void add_file(const std::string &name, const std::string &filename) {
+            mapped_file file(filename);
+            add(name, file.data(), file.size());
+        }
+        
+        unsigned long size() const { return models_.size(); }
+        
+        // bytes of sections stored once for several models
+        uint64 shared_bytes() const { return shared_bytes_; }
+        
+        /**
+         *  writes the container and returns its size
+         */
+        uint64 write(std::ostream &os) const {
+            uint64 directory_size = 4 * sizeof(uint64) + blobs_.size() * 2 * sizeof(uint64);
+            for (auto &model: models_) {
+                directory_size += 2 * sizeof(uint64) + model.name.size() + model.blobs.size() * sizeof(uint64);
+            }
+            
+            std::vector<uint64> offsets(blobs_.size());
+            uint64 offset = directory_size;
+            for (uint64 idx = 0; idx < blobs_.size(); ++ idx) {
+                offset = align(offset);
+                offsets[idx] = offset;
+                offset += blobs_[idx].size();
+            }
+            
+            write_single_value(os, CONTAINER_MAGIC);
+            write_single_value(os, CONTAINER_VERSION);
+            uint64 model_num = models_.size(), blob_num = blobs_.size();
+            write_single_value(os, model_num);
+            write_single_value(os, blob_num);
+            for (uint64 idx = 0; idx < blobs_.size(); ++ idx) {
+                uint64 blob_size = blobs_[idx].size();
+                write_single_value(os, offsets[idx]);
+                write_single_value(os, blob_size);
+            }
+            for (auto &model: models_) {
+                uint64 name_size = model.name.size(), section_num = model.blobs.size();
+                write_single_value(os, name_size);
+                os.write(model.name.data(), model.name.size());
+                write_single_value(os, section_num);
+                for (uint64 blob: model.blobs) write_single_value(os, blob);
+            }
+            
+            uint64 position = directory_size;
+            const char zeros[CONTAINER_ALIGNMENT] = {0};
+            for (uint64 idx = 0; idx < blobs_.size(); ++ idx) {
+                os.write(zeros, offsets[idx] - position);
+                os.write(blobs_[idx].data(), blobs_[idx].size());
+                position = offsets[idx] + blobs_[idx].size();
+            }
+            if (!os) throw dlib::serialization_error("Unable to write model container.");
+            return position;
+        }
+        
+        uint64 save(const std::string &filename) const {
+            std::ofstream os(filename, std::ofstream::binary);
+            if (!os) throw dlib::serialization_error("Unable to open " + filename + " for writing.");
+            return write(os);
+        }
+    
+    private:
+        struct model_entry {
+            std::string name;
+            std::vector<uint64> blobs;
+        };
+        
+        static uint64 align(uint64 offset) {
+            return (offset + CONTAINER_ALIGNMENT - 1) / CONTAINER_ALIGNMENT * CONTAINER_ALIGNMENT;
+        }
+        
+        uint64 add_blob(const byte_view &section) {
+            const uint64 hash = fnv1a_hash(section.data, section.size);
+            auto range = blob_index_.equal_range(hash);
+            for (auto it = range.first; it != range.second; ++ it) {
+                const std::string &blob = blobs_[it->second];
+                if (blob.size() == section.size && std::equal(blob.begin(), blob.end(), section.data)) {
+                    shared_bytes_ += section.size;
+                    return it->second;
+                }
+            }
+            blobs_.push_back(std::string(section.data, section.size));
+            blob_index_.insert(std::make_pair(hash, static_cast<uint64>(blobs_.size() - 1)));
+            return blobs_.size() - 1;
+        }
+        
+        std::vector<model_entry> models_;
+        std::vector<std::string> blobs_;
+        std::unordered_multimap<uint64, uint64> blob_index_;     // blobs by hash
+        uint64 shared_bytes_;
+    };
+    
+    /**
+     *  directory of a container, mapped from a file or over an image in memory
+     */
+    class model_container {
+    public:
+        model_container() {}
+        
+        explicit model_container(const std::string &filename) {
+            open(filename);
+        }
+        
+        model_container(const uint8 *data, uint64 size) {
+            open(data, size);
+        }
+        
+        void open(const std::string &filename) {
+            file_.open(filename);
+            parse(file_.data(), file_.size());
+        }
+        
+        /**
+         *  the image is not copied and must outlive the container and the sections it
+         *  returns
+         */
+        void open(const uint8 *data, uint64 size) {
+            file_.close();
+            parse(reinterpret_cast<const char *>(data), size);
+        }
+        
+        // model names in the order they were added
+        const std::vector<std::string> &names() const { return names_; }
+        
+        bool contains(const std::string &name) const { return models_.count(name) != 0; }
+        
+        /**
+         *  sections of the model name, pointing into the container, for parse_model_layout
+         */
+        std::vector<byte_view> sections(const std::string &name) const {
+            auto it = models_.find(name);
+            if (it == models_.end()) throw dlib::serialization_error("No model " + name + " in container.");
+            std::vector<byte_view> sections;
+            for (uint64 blob: it->second) sections.push_back(blobs_[blob]);
+            return sections;
+        }
+    
+    private:
+        model_container(const model_container &);
+        model_container &operator=(const model_container &);
+        
+        void parse(const char *data, uint64 size) {
+            names_.clear();
+            models_.clear();
+            blobs_.clear();
+            if (!is_model_container(data, size)) throw dlib::serialization_error("Not a model container.");
+            if (size < 4 * sizeof(uint64)) throw dlib::serialization_error("Truncated model container.");
+            if (load_value<uint64>(data + sizeof(uint64)) > CONTAINER_VERSION) throw dlib::serialization_error("Unsupported model container version.");
+            const uint64 model_num = load_value<uint64>(data + 2 * sizeof(uint64));
+            const uint64 blob_num = load_value<uint64>(data + 3 * sizeof(uint64));
+            const char *p = data + 4 * sizeof(uint64);
+            const char *end = data + size;
+            
+            if (blob_num > static_cast<uint64>(end - p) / (2 * sizeof(uint64))) throw dlib::serialization_error("Truncated model container.");
+            for (uint64 idx = 0; idx < blob_num; ++ idx) {
+                byte_view blob;
+                const uint64 offset = load_value<uint64>(p);
+                blob.size = load_value<uint64>(p + sizeof(uint64));
+                p += 2 * sizeof(uint64);
+                if (offset > size || blob.size > size - offset) throw dlib::serialization_error("Truncated model container.");
+                blob.data = data + offset;
+                blobs_.push_back(blob);
+            }
+            
+            for (uint64 model = 0; model < model_num; ++ model) {
+                if (end - p < static_cast<long>(sizeof(uint64))) throw dlib::serialization_error("Truncated model container.");
+                const uint64 name_size = load_value<uint64>(p);
+                p += sizeof(uint64);
+                if (name_size > static_cast<uint64>(end - p)) throw dlib::serialization_error("Truncated model container.");
+                std::string name(p, name_size);
+                p += name_size;
+                if (end - p < static_cast<long>(sizeof(uint64))) throw dlib::serialization_error("Truncated model container.");
+                const uint64 section_num = load_value<uint64>(p);
+                p += sizeof(uint64);
+                if (section_num > static_cast<uint64>(end - p) / sizeof(uint64)) throw dlib::serialization_error("Truncated model container.");
+                if (models_.count(name)) throw dlib::serialization_error("Duplicate model " + name + " in container.");
+                std::vector<uint64> &blobs = models_[name];
+                for (uint64 idx = 0; idx < section_num; ++ idx) {
+                    const uint64 blob = load_value<uint64>(p);
+                    p += sizeof(uint64);
+                    if (blob >= blob_num) throw dlib::serialization_error("Invalid section in model container.");
+                    blobs.push_back(blob);
+                }
+                names_.push_back(name);
+            }
+        }
+        
+        mapped_file file_;
+        std::vector<std::string> names_;
+        std::unordered_map<std::string, std::vector<uint64> > models_;     // blob of every section
+        std::vector<byte_view> blobs_;
+    };
+    
+    /**
+     *  load the model name of a container
+     */
+    void load_shape_predictor_model(dlib::shape_predictor &sp, const model_container &container, const std::string &name,
+                                    unsigned long num_threads=0, model_stats *stats=NULL) {
+        model_layout layout;
+        parse_model_layout(container.sections(name), layout);
+        load_shape_predictor_model(sp, layout, num_threads, stats);
+    }
+
+}
+
+#endif /* model_container_h */
@@ -0,0 +1,230 @@
+//
+//  model_registry.hpp
+//  dlib_utils
+//
+//  Created by zhaoyu on 2018/1/8.
+//  Copyright © 2018 zhaoyu. All rights reserved.
+//
+
+#ifndef model_registry_h
+#define model_registry_h
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>         // stat, or _stat64 on Windows
+#include <model_utils.hpp>
+#include <compressed_shape_predictor.hpp>
+
+
+namespace med {
+    
+    /**
+     *  build a model of the registry from a mapped compressed model file
+     */
+    inline void load_registry_model(dlib::shape_predictor &sp, const mapped_file &file) {
+        model_layout layout;
+        parse_model_layout(file.data(), file.size(), layout);
+        load_shape_predictor_model(sp, layout);
+    }
+    
+    // runs on the mapping of the registry, which lives as long as the model
+    inline void load_registry_model(compressed_shape_predictor &sp, const mapped_file &file) {
+        sp.open(reinterpret_cast<const uint8 *>(file.data()), file.size());
+    }
+    
+    /**
+     *  process-wide cache of loaded compressed models
+     *
+     *  get() decodes a model the first time its file is asked for and afterwards
+     *  returns the same read-only instance to every caller, so pipelines that use the
+     *  same model share one copy. Files with identical contents share one instance too:
+     *  the registry keeps every model file mapped and compares the bytes of files
+     *  with the same hash. When the modification time or size of a file changes, the
+     *  next get() reloads it if its contents changed; callers still holding the old
+     *  model keep it alive until they drop it. predictor_type is dlib::shape_predictor
+     *  or compressed_shape_predictor, both of which are safe to use from several
+     *  threads.
+     *
+     *  Files are mapped, not copied, so a model file must be replaced by writing the
+     *  new one next to it and renaming it over the old one. Rewriting a file in place
+     *  changes the bytes under the models already loaded from it, and truncating it
+     *  makes them fault with SIGBUS.
+     *
+     *  Files are mapped, hashed and decoded outside the lock of the registry, so a
+     *  slow model does not hold up get() for other files.
+     */
+    template <typename predictor_type>
+    class model_registry {
+    public:
+        typedef std::shared_ptr<const predictor_type> handle;
+        
+        model_registry() {}
+        
+        static model_registry &shared() {
+            static model_registry registry;
+            return registry;
+        }
+        
+        handle get(const std::string &filename) {
+            const file_stamp stamp = stat_file(filename);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = entries_.find(filename);
+                if (it != entries_.end() && it->second.stamp == stamp) return handle_of(it->second.model);
+            }
+            
+            std::shared_ptr<loaded_model> loaded = std::make_shared<loaded_model>();
+            loaded->file.open(filename);
+            const uint64 hash = fnv1a_hash(loaded->file.data(), loaded->file.size());
+            {
+                // touched but with the same contents, or the same contents as another file
+                std::lock_guard<std::mutex> lock(mutex_);
+                std::shared_ptr<const loaded_model> same = find_same(filename, hash, loaded->file);
+                if (same) return handle_of(insert(filename, stamp, hash, same));
+            }
+            
+            load_registry_model(loaded->model, loaded->file);
+            
+            // another get() may have loaded the same contents in the meantime
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::shared_ptr<const loaded_model> same = find_same(filename, hash, loaded->file);
+            if (same) return handle_of(insert(filename, stamp, hash, same));
+            by_hash_.insert(std::make_pair(hash, std::weak_ptr<const loaded_model>(loaded)));
+            return handle_of(insert(filename, stamp, hash, loaded));
+        }
+        
+        /**
+         *  reload every file that changed on disk since it was last loaded
+         */
+        void reload_changed() {
+            std::vector<std::string> filenames;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (auto &it: entries_) filenames.push_back(it.first);
+            }
+            for (auto &filename: filenames) get(filename);
+        }
+        
+        // handles already returned stay valid
+        void evict(const std::string &filename) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            entries_.erase(filename);
+            prune_hashes();
+        }
+        
+        // drop the models that nobody but the registry holds
+        void evict_unused() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto it = entries_.begin(); it != entries_.end(); ) {
+                if (it->second.model.use_count() == 1) it = entries_.erase(it);
+                else ++ it;
+            }
+            prune_hashes();
+        }
+        
+        void clear() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            entries_.clear();
+            by_hash_.clear();
+        }
+        
+        unsigned long size() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return entries_.size();
+        }
+    
+    private:
+        model_registry(const model_registry &);
+        model_registry &operator=(const model_registry &);
+        
+        struct file_stamp {
+            int64 mtime;        // in nanoseconds where the file system has them
+            uint64 size;
+            bool operator==(const file_stamp &other) const { return mtime == other.mtime && size == other.size; }
+        };
+        
+        // a model with the mapping of the file it was loaded from
+        struct loaded_model {
+            mapped_file file;
+            predictor_type model;
+        };
+        
+        struct entry {
+            std::shared_ptr<const loaded_model> model;
+            uint64 hash;
+            file_stamp stamp;
+        };
+        
+        // handles share the ownership of the model and its mapping
+        static handle handle_of(const std::shared_ptr<const loaded_model> &model) {
+            return handle(model, &model->model);
+        }
+        
+        static bool same_bytes(const mapped_file &a, const mapped_file &b) {
+            return a.size() == b.size() && (a.size() == 0 || std::memcmp(a.data(), b.data(), a.size()) == 0);
+        }
+        
+        /**
+         *  a loaded model with the contents of file: the one of filename itself, or of
+         *  another file. Called with the lock held.
+         */
+        std::shared_ptr<const loaded_model> find_same(const std::string &filename, uint64 hash, const mapped_file &file) const {
+            auto it = entries_.find(filename);
+            if (it != entries_.end() && it->second.hash == hash && same_bytes(it->second.model->file, file)) return it->second.model;
+            auto range = by_hash_.equal_range(hash);
+            for (auto same = range.first; same != range.second; ++ same) {
+                std::shared_ptr<const loaded_model> model = same->second.lock();
+                if (model && same_bytes(model->file, file)) return model;
+            }
+            return std::shared_ptr<const loaded_model>();
+        }
+        
+        const std::shared_ptr<const loaded_model> &insert(const std::string &filename, const file_stamp &stamp, uint64 hash,
+                                                          const std::shared_ptr<const loaded_model> &model) {
+            entry &e = entries_[filename];
+            e.model = model;
+            e.hash = hash;
+            e.stamp = stamp;
+            return e.model;
+        }
+        
+        static file_stamp stat_file(const std::string &filename) {
+#if defined(_WIN32)
+            struct _stat64 st;
+            if (::_stat64(filename.c_str(), &st) != 0) throw dlib::serialization_error("Unable to stat " + filename);
+#else
+            struct stat st;
+            if (::stat(filename.c_str(), &st) != 0) throw dlib::serialization_error("Unable to stat " + filename);
+#endif
+            file_stamp stamp;
+#if defined(__APPLE__)
+            stamp.mtime = static_cast<int64>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+            stamp.mtime = static_cast<int64>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#else
+            stamp.mtime = static_cast<int64>(st.st_mtime);
+#endif
+            stamp.size = static_cast<uint64>(st.st_size);
+            return stamp;
+        }
+        
+        void prune_hashes() {
+            for (auto it = by_hash_.begin(); it != by_hash_.end(); ) {
+                if (it->second.expired()) it = by_hash_.erase(it);
+                else ++ it;
+            }
+        }
+        
+        mutable std::mutex mutex_;
+        std::unordered_map<std::string, entry> entries_;
+        std::unordered_multimap<uint64, std::weak_ptr<const loaded_model> > by_hash_;
+    };
+    
+}
+
+#endif /* model_registry_h */
@@ -12,9 +12,30 @@
 #include <vector>
 #include <unordered_map>
 #include <fstream>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <algorithm>
+#include <random>
+#include <limits>
 #include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include <dlib/image_processing.h>
+#include <dlib/threads.h>
 #include <huffman.hpp>
+#include <tans.hpp>
 
 
 namespace med {
@@ -37,7 +58,7 @@ namespace med {
      *  utils for reading and writing
      */
     template <typename T>
-    void write_single_value(std::ofstream &os, const T &data) {
+    void write_single_value(std::ostream &os, const T &data) {
         os.write(reinterpret_cast<const char *>(&data), sizeof(T));
     }
     
@@ -46,7 +67,7 @@ namespace med {
         is.read(reinterpret_cast<char *>(&data), sizeof(T));
     }
     
-    void write_char_vec(std::ofstream &os, const std::vector<char> &data) {
+    void write_char_vec(std::ostream &os, const std::vector<char> &data) {
         os.write(&data[0], data.size());
     }
     
@@ -75,7 +96,7 @@ namespace med {
         out.swap(data);
     }
     
-    void chars_to_bits(const std::vector<char> &chars, std::vector<bool> &out, unsigned long bit_num) {
+    void chars_to_bits(const char *chars, std::vector<bool> &out, unsigned long bit_num) {
         std::vector<bool> data(bit_num, false);
         for (int idx = 0; idx < bit_num; ++ idx) {
             int c = idx / 8;
@@ -85,37 +106,968 @@ namespace med {
         out.swap(data);
     }
     
+    void chars_to_bits(const std::vector<char> &chars, std::vector<bool> &out, unsigned long bit_num) {
+        chars_to_bits(chars.data(), out, bit_num);
+    }
+    
+    inline uint64 load_be64(const uint8 *p) {
+        return (static_cast<uint64>(p[0]) << 56) | (static_cast<uint64>(p[1]) << 48) |
+               (static_cast<uint64>(p[2]) << 40) | (static_cast<uint64>(p[3]) << 32) |
+               (static_cast<uint64>(p[4]) << 24) | (static_cast<uint64>(p[5]) << 16) |
+               (static_cast<uint64>(p[6]) << 8)  |  static_cast<uint64>(p[7]);
+    }
+    
+    /**
+     *  reads a MSB-first bit stream (the layout written by bits_to_chars) through a
+     *  64-bit buffer that is refilled a whole word at a time. Reading past the end
+     *  yields zero bits.
+     */
+    class bit_reader {
+    public:
+        bit_reader(const char *data, uint64 size, uint64 bit_offset=0) :
+        data_(reinterpret_cast<const uint8 *>(data)), size_(size), pos_(bit_offset / 8), buf_(0), count_(0) {
+            skip(static_cast<unsigned int>(bit_offset % 8));
+        }
+        
+        // next n bits (1 <= n <= 32) without consuming them
+        inline uint32 peek(unsigned int n) {
+            if (count_ < n) refill();
+            return static_cast<uint32>(buf_ >> (64 - n));
+        }
+        
+        inline void skip(unsigned int n) {
+            if (count_ < n) refill();
+            buf_ <<= n;
+            count_ -= n;
+        }
+        
+        // next n bits (0 <= n <= 32), consumed
+        inline uint32 read(unsigned int n) {
+            if (count_ < n) refill();
+            uint32 v = static_cast<uint32>((buf_ >> 1) >> (63 - n));
+            buf_ <<= n;
+            count_ -= n;
+            return v;
+        }
+        
+        // number of bits consumed from the start of the stream
+        uint64 tell() const {
+            return pos_ * 8 - count_;
+        }
+        
+    private:
+        inline void refill() {
+            if (pos_ + 8 <= size_) {
+                buf_ |= load_be64(data_ + pos_) >> count_;
+                pos_ += (63 - count_) >> 3;
+                count_ |= 56;
+            } else {
+                while (count_ <= 56) {
+                    uint64 byte = pos_ < size_ ? data_[pos_] : 0;
+                    buf_ |= byte << (56 - count_);
+                    ++ pos_;
+                    count_ += 8;
+                }
+            }
+        }
+        
+        const uint8 *data_;
+        uint64 size_;
+        uint64 pos_;
+        uint64 buf_;
+        unsigned int count_;
+    };
+    
+    /**
+     *  bump allocator for data that lives as long as its owner, such as the decoded
+     *  leaves of a model. Memory is taken in blocks of at least block_size bytes, every
+     *  allocation starts on an ARENA_ALIGNMENT byte boundary, and everything is freed
+     *  at once by clear() or the destructor. Not thread safe.
+     */
+    const uint64 ARENA_ALIGNMENT = 64;
+    
+    class aligned_arena {
+    public:
+        explicit aligned_arena(uint64 block_size=1 << 20) : block_size_(block_size), block_(NULL), used_(0), capacity_(0), bytes_(0) {}
+        
+        template <typename T>
+        T *allocate(uint64 n) {
+            const uint64 size = allocation_size<T>(n);
+            reserve(size);
+            T *p = reinterpret_cast<T *>(block_ + used_);
+            used_ += size;
+            return p;
+        }
+        
+        // bytes that allocate<T>(n) takes from a block
+        template <typename T>
+        static uint64 allocation_size(uint64 n) {
+            return std::max<uint64>(1, (n * sizeof(T) + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT) * ARENA_ALIGNMENT;
+        }
+        
+        // makes the next allocations of up to size bytes in total follow each other
+        // in one block
+        void reserve(uint64 size) {
+            if (!blocks_.empty() && used_ + size <= capacity_) return;
+            capacity_ = std::max(block_size_, size);
+            blocks_.push_back(std::unique_ptr<char[]>(new char[capacity_ + ARENA_ALIGNMENT]));
+            const std::uintptr_t base = reinterpret_cast<std::uintptr_t>(blocks_.back().get());
+            block_ = reinterpret_cast<char *>((base + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT);
+            used_ = 0;
+            bytes_ += capacity_;
+        }
+        
+        void clear() {
+            blocks_.clear();
+            used_ = capacity_ = bytes_ = 0;
+        }
+        
+        // bytes taken from the heap
+        uint64 bytes() const { return bytes_; }
+        
+    private:
+        aligned_arena(const aligned_arena &);
+        aligned_arena &operator=(const aligned_arena &);
+        
+        uint64 block_size_;
+        std::vector<std::unique_ptr<char[]> > blocks_;
+        char *block_;
+        uint64 used_;
+        uint64 capacity_;
+        uint64 bytes_;
+    };
+    
+    /**
+     *  instrumentation
+     *
+     *  Saving and loading record the wall time, bytes and heap allocations of every
+     *  section into a model_stats if they are given one, and compressed_shape_predictor
+     *  records the time spent in every cascade level. Allocations are counted only if
+     *  one translation unit defines MED_COUNT_ALLOCATIONS before including this header,
+     *  which replaces the global operator new; otherwise they are 0.
+     */
+    inline std::atomic<uint64> &allocation_counter() {
+        static std::atomic<uint64> counter(0);
+        return counter;
+    }
+    
+    struct stage_stats {
+        std::string name;
+        double ms;
+        uint64 bytes;
+        uint64 allocations;
+    };
+    
+    struct model_stats {
+        model_stats() : faces(0) {}
+        
+        std::vector<stage_stats> stages;
+        // inference time of every cascade level, summed over all predicted faces
+        std::vector<double> level_ms;
+        uint64 faces;
+        
+        void clear() {
+            stages.clear();
+            level_ms.clear();
+            faces = 0;
+        }
+        
+        std::string to_json() const {
+            std::ostringstream os;
+            os << "{\"stages\": [";
+            for (unsigned long idx = 0; idx < stages.size(); ++ idx) {
+                const stage_stats &stage = stages[idx];
+                os << (idx ? ", " : "") << "{\"name\": \"" << stage.name << "\", \"ms\": " << stage.ms
+                   << ", \"bytes\": " << stage.bytes << ", \"allocations\": " << stage.allocations << "}";
+            }
+            os << "], \"levels\": [";
+            for (unsigned long idx = 0; idx < level_ms.size(); ++ idx) {
+                os << (idx ? ", " : "") << "{\"level\": " << idx << ", \"ms\": " << level_ms[idx]
+                   << ", \"us_per_face\": " << (faces ? level_ms[idx] * 1000 / faces : 0) << "}";
+            }
+            os << "], \"faces\": " << faces << "}";
+            return os.str();
+        }
+    };
+    
+    /**
+     *  records consecutive stages into a model_stats, each one from the end of the
+     *  previous one. Does nothing without a model_stats.
+     */
+    class stage_recorder {
+    public:
+        explicit stage_recorder(model_stats *stats) : stats_(stats), allocations_(0) {
+            restart();
+        }
+        
+        void restart() {
+            if (!stats_) return;
+            start_ = std::chrono::steady_clock::now();
+            allocations_ = allocation_counter().load(std::memory_order_relaxed);
+        }
+        
+        void record(const std::string &name, uint64 bytes) {
+            if (!stats_) return;
+            stage_stats stage;
+            stage.name = name;
+            stage.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_).count();
+            stage.bytes = bytes;
+            stage.allocations = allocation_counter().load(std::memory_order_relaxed) - allocations_;
+            stats_->stages.push_back(stage);
+            restart();
+        }
+        
+    private:
+        model_stats *stats_;
+        std::chrono::steady_clock::time_point start_;
+        uint64 allocations_;
+    };
+    
+    /**
+     *  model format
+     *
+     *  version 0: header, initial_shape, anchor_idx, deltas, splits, code table, leaf values
+     *  version 1: the header ends with a uint64 of MODEL_FLAG_* bits, and sections that
+     *             are enabled by a flag follow the ones of version 0 in flag order
+     *  version 2: as version 1, with the leaf values coded by tANS instead of Huffman
+     *             codes. Every block of the leaf index starts a new tANS stream.
+     */
+    const uint64 MODEL_VERSION_LATEST = 2;
+    // first version whose leaf values are coded by tANS
+    const uint64 MODEL_VERSION_TANS = 2;
+    
+    // leaf index section before the leaf values: bit offset of every block of trees
+    const uint64 MODEL_FLAG_LEAF_INDEX = 1;
+    // runs of zero values inside a leaf vector are coded as one symbol each
+    const uint64 MODEL_FLAG_ZERO_RUN = 2;
+    // the code table section holds one code table per cascade level
+    const uint64 MODEL_FLAG_LEVEL_CODE_TABLES = 4;
+    // splits are packed into 32 bits with an integer threshold, see pack_split
+    const uint64 MODEL_FLAG_PACKED_SPLITS = 8;
+    // the packed splits are stored as a bit stream with short indices and Huffman
+    // coded thresholds, see write_coded_splits. Set together with MODEL_FLAG_PACKED_SPLITS.
+    const uint64 MODEL_FLAG_CODED_SPLITS = 16;
+    // the leaf values of a level are the rows of a codebook, and a section after the
+    // leaf values holds the row of every tree leaf, see write_leaf_rows
+    const uint64 MODEL_FLAG_LEAF_CODEBOOK = 32;
+    // Huffman codes are canonical and stored as their code lengths only, see write_codes
+    const uint64 MODEL_FLAG_CANONICAL_CODES = 64;
+    
+    /**
+     *  how the quantization step of the leaf values is chosen
+     */
+    enum quantizer_type {
+        QUANTIZER_MODEL = 0,        // one step for the whole model: (max - min) / quantization_num
+        QUANTIZER_LEVEL = 1,        // one step per cascade level, from the range of the level
+        QUANTIZER_COORDINATE = 2    // one step per cascade level and leaf coordinate
+    };
+    
+    struct compression_options {
+        compression_options() :
+        prune_thresh(0.0001), quantization_num(512), version(MODEL_VERSION_LATEST), index_block_trees(50),
+        zero_run(true), quantizer(QUANTIZER_MODEL), level_code_tables(true), packed_splits(false),
+        coded_splits(false), leaf_codebook_size(0), codebook_iterations(10), num_threads(0) {}
+        
+        float32 prune_thresh;
+        uint64 quantization_num;
+        uint64 version;
+        // trees per independently decodable block of the leaf stream (version >= 1)
+        uint64 index_block_trees;
+        // code zero runs instead of single zero values where that makes the leaf
+        // stream smaller (version >= 1)
+        bool zero_run;
+        // quantizers other than QUANTIZER_MODEL always use one code table per level
+        // (version >= 1)
+        quantizer_type quantizer;
+        // one code table per cascade level where that makes the model smaller (version >= 1)
+        bool level_code_tables;
+        // 4 byte splits with thresholds rounded to integer pixel differences, exact
+        // for 8-bit images (version >= 1, feature_pool_size <= 2048)
+        bool packed_splits;
+        // packed splits with ceil(log2(feature_pool_size)) bit indices and Huffman coded
+        // thresholds, decoded when the model is loaded (implies packed_splits)
+        bool coded_splits;
+        // cluster the leaf vectors of every level into a codebook of this many rows and
+        // store the row of every leaf instead of its values, 0 to store every leaf
+        // (version >= 1, at most LEAF_CODEBOOK_MAX_SIZE)
+        uint64 leaf_codebook_size;
+        // k-means iterations of the codebook
+        uint64 codebook_iterations;
+        // threads of the codebook k-means, 0 for one per core
+        unsigned long num_threads;
+    };
+    
+    const uint64 LEAF_CODEBOOK_MAX_SIZE = 65536;
+    
+    /**
+     *  a split packed into 32 bits: idx1 in bits 0-10, idx2 in bits 11-21, and the
+     *  threshold in bits 22-31 as a signed integer pixel difference in [-256, 255]
+     *
+     *  For integer pixel differences d, d > thresh is the same as d > floor(thresh),
+     *  and every d of 8-bit pixels lies in [-255, 255], so the clamped floor decides
+     *  every split the way the float threshold does.
+     */
+    const uint64 PACKED_SPLIT_MAX_FEATURES = 2048;
+    
+    inline int32 packed_split_threshold(float thresh) {
+        return static_cast<int32>(std::floor(std::max(-256.f, std::min(255.f, thresh))));
+    }
+    
+    inline uint32 pack_split(unsigned long idx1, unsigned long idx2, int32 thresh) {
+        return static_cast<uint32>(idx1) | (static_cast<uint32>(idx2) << 11) | (static_cast<uint32>(thresh) << 22);
+    }
+    
+    inline unsigned long packed_split_idx1(uint32 split) { return split & 0x7ff; }
+    inline unsigned long packed_split_idx2(uint32 split) { return (split >> 11) & 0x7ff; }
+    inline int32 packed_split_thresh(uint32 split) { return static_cast<int32>(split) >> 22; }
+    
+    /**
+     *  symbols of one leaf vector: its quantization values, or, with zero runs, the
+     *  quantization values with every run of n zeros replaced by zero_run_base + n.
+     *  Values below prune_thresh in magnitude are pruned to 0.
+     */
+    void quantize_leaf(const dlib::matrix<float,0,1> &leaf_value, const std::vector<float32> &quantization_precision,
+                       float32 prune_thresh, bool zero_run, int32 zero_run_base, std::vector<int> &symbols) {
+        symbols.clear();
+        int32 run = 0;
+        for (long idx = 0; idx < leaf_value.size(); ++ idx) {
+            const float v = std::fabs(leaf_value(idx)) < prune_thresh ? 0.f : leaf_value(idx);
+            int quantization_value = static_cast<int>(std::round(v / quantization_precision[idx]));
+            if (zero_run && quantization_value == 0) {
+                ++ run;
+                continue;
+            }
+            if (run) symbols.push_back(zero_run_base + run);
+            run = 0;
+            symbols.push_back(quantization_value);
+        }
+        if (run) symbols.push_back(zero_run_base + run);
+    }
+    
+    /**
+     *  k-means of the leaf vectors of one cascade level, with the values below
+     *  prune_thresh in magnitude pruned to 0, into k rows, seeded by k-means++ with a
+     *  fixed seed so that saving is deterministic. rows gets the row of every leaf. A row that loses all its leaves moves to the leaf farthest from its own row.
+     *  The leaves are assigned to their rows on num_threads threads, 0 for one per core.
+     */
+    void cluster_leaves(const std::vector<const dlib::matrix<float,0,1> *> &leaves, float32 prune_thresh, uint64 k,
+                        uint64 iterations, std::vector<dlib::matrix<float,0,1> > &centroids, std::vector<uint32> &rows,
+                        unsigned long num_threads=0) {
+        const uint64 n = leaves.size();
+        const uint64 dim = n ? leaves[0]->size() : 0;
+        k = std::min(k, n);
+        std::vector<float> points(n * dim), centers(k * dim);
+        for (uint64 p = 0; p < n; ++ p) {
+            for (uint64 idx = 0; idx < dim; ++ idx) {
+                const float v = (*leaves[p])(idx);
+                points[p * dim + idx] = std::fabs(v) < prune_thresh ? 0.f : v;
+            }
+        }
+        auto distance = [&](uint64 p, uint64 c) {
+            float d = 0;
+            for (uint64 idx = 0; idx < dim; ++ idx) {
+                const float v = points[p * dim + idx] - centers[c * dim + idx];
+                d += v * v;
+            }
+            return d;
+        };
+        auto set_center = [&](uint64 c, uint64 p) {
+            std::copy(points.begin() + p * dim, points.begin() + (p + 1) * dim, centers.begin() + c * dim);
+        };
+        
+        // k-means++: every next seed is a leaf drawn with probability proportional to
+        // its squared distance from the seeds so far
+        std::mt19937 rng(0);
+        std::vector<float> dist(n);
+        rows.assign(n, 0);
+        if (k) set_center(0, std::uniform_int_distribution<uint64>(0, n - 1)(rng));
+        for (uint64 p = 0; p < n && k; ++ p) dist[p] = distance(p, 0);
+        for (uint64 c = 1; c < k; ++ c) {
+            double total = 0;
+            for (float d: dist) total += d;
+            uint64 seed = c;
+            if (total > 0) {
+                double r = std::uniform_real_distribution<double>(0, total)(rng);
+                for (seed = 0; seed + 1 < n && (r -= dist[seed]) > 0; ++ seed) {}
+            }
+            set_center(c, seed);
+            for (uint64 p = 0; p < n; ++ p) {
+                const float d = distance(p, c);
+                if (d < dist[p]) {
+                    dist[p] = d;
+                    rows[p] = static_cast<uint32>(c);
+                }
+            }
+        }
+        
+        if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<double> sums(k * dim);
+        std::vector<uint64> counts(k);
+        for (uint64 it = 0; it < iterations; ++ it) {
+            std::fill(sums.begin(), sums.end(), 0.);
+            std::fill(counts.begin(), counts.end(), 0);
+            for (uint64 p = 0; p < n; ++ p) {
+                ++ counts[rows[p]];
+                for (uint64 idx = 0; idx < dim; ++ idx) sums[rows[p] * dim + idx] += points[p * dim + idx];
+            }
+            for (uint64 c = 0; c < k; ++ c) {
+                if (counts[c] == 0) {
+                    const uint64 p = std::max_element(dist.begin(), dist.end()) - dist.begin();
+                    set_center(c, p);
+                    dist[p] = 0;
+                    continue;
+                }
+                for (uint64 idx = 0; idx < dim; ++ idx) centers[c * dim + idx] = static_cast<float>(sums[c * dim + idx] / counts[c]);
+            }
+            
+            std::atomic<uint64> changed(0);
+            dlib::parallel_for(num_threads, 0, static_cast<long>(n), [&](long p) {
+                uint32 best = 0;
+                float best_dist = distance(p, 0);
+                for (uint64 c = 1; c < k; ++ c) {
+                    const float d = distance(p, c);
+                    if (d < best_dist) {
+                        best_dist = d;
+                        best = static_cast<uint32>(c);
+                    }
+                }
+                if (best != rows[p]) ++ changed;
+                rows[p] = best;
+                dist[p] = best_dist;
+            });
+            if (changed == 0) break;
+        }
+        
+        centroids.resize(k);
+        for (uint64 c = 0; c < k; ++ c) {
+            centroids[c].set_size(dim, 1);
+            for (uint64 idx = 0; idx < dim; ++ idx) centroids[c](idx) = centers[c * dim + idx];
+        }
+    }
+    
+    /**
+     *  code table of the leaf values of one cascade level, or of all of them
+     *
+     *  quantization_precision has one step per leaf coordinate. The symbols are coded
+     *  by the Huffman codes of ctbl, or by tans_table if tans is set. decode_table is
+     *  only built when a Huffman table is loaded.
+     */
+    struct leaf_code_table {
+        leaf_code_table() : tans(false), canonical(false), zero_run(false), zero_run_base(0) {}
+        
+        std::vector<float32> quantization_precision;
+        bool tans;
+        // ctbl is stored as code lengths, see write_codes
+        bool canonical;
+        codetable ctbl;
+        TansTable tans_table;
+        bool zero_run;
+        int32 zero_run_base;
+        HuffmanDecodeTable decode_table;
+        
+        bool has_code(int symbol) const {
+            if (tans) return tans_table.symbol_index.count(symbol) != 0;
+            return ctbl.count(symbol) != 0;
+        }
+    };
+    
+    inline const leaf_code_table &level_code_table(const std::vector<leaf_code_table> &tables, uint64 level) {
+        return tables[tables.size() == 1 ? 0 : level];
+    }
+    
+    codetable build_code_table(const std::unordered_map<int, unsigned long> &frequency) {
+        codetable ctbl;
+        if (frequency.size() == 1) {
+            // a tree of a single symbol has no edges, give the symbol a one bit code
+            ctbl[frequency.begin()->first] = code_t(1, false);
+            return ctbl;
+        }
+        std::vector<std::pair<int, unsigned long> > cfvec(frequency.begin(), frequency.end());
+        return build_canonical_table(cfvec);
+    }
+    
+    /**
+     *  builds the code of table for symbols with the given frequencies and returns the
+     *  number of bits they take
+     */
+    uint64 build_symbol_code(const std::unordered_map<int, unsigned long> &frequency, leaf_code_table &table) {
+        uint64 bits_num = 0;
+        if (table.tans) {
+            const unsigned int table_log = choose_table_log(frequency);
+            table.tans_table = build_tans_table(normalize_frequencies(frequency, table_log), table_log);
+            return static_cast<uint64>(std::ceil(tans_cost_bits(table.tans_table, frequency)));
+        }
+        table.ctbl = build_code_table(frequency);
+        for (auto &it: frequency) bits_num += it.second * table.ctbl[it.first].size();
+        return bits_num;
+    }
+    
+    /**
+     *  Huffman or tANS code, as set by table.tans, of quantization values with the
+     *  given frequencies, and of runs of zeros of the given lengths if zero_run is
+     *  allowed and shortens the stream. Returns the number of bits of the coded values.
+     */
+    uint64 build_leaf_code_table(const std::unordered_map<int, unsigned long> &value_frequency,
+                                 const std::unordered_map<int, unsigned long> &run_frequency,
+                                 bool zero_run, leaf_code_table &table) {
+        table.zero_run = zero_run;
+        table.zero_run_base = 0;
+        if (!zero_run) return build_symbol_code(value_frequency, table);
+        
+        // zero run symbols start above the largest quantization value
+        for (auto &it: value_frequency) table.zero_run_base = std::max(table.zero_run_base, it.first);
+        std::unordered_map<int, unsigned long> frequency;
+        for (auto &it: value_frequency) {
+            if (it.first != 0) frequency[it.first] = it.second;
+        }
+        for (auto &it: run_frequency) frequency[table.zero_run_base + it.first] = it.second;
+        
+        // zero runs cost more than they save when few values are pruned, in which case
+        // the stream keeps single zero values and simply contains no run symbols. The
+        // choice is made on the Huffman code for tANS too: zeros cost a fraction of a
+        // bit there, and single zeros often come out a little shorter while leaving
+        // many more symbols to decode
+        leaf_code_table value_table, run_table;
+        const bool use_runs = !frequency.empty() &&
+            build_symbol_code(frequency, run_table) < build_symbol_code(value_frequency, value_table);
+        return build_symbol_code(use_runs ? frequency : value_frequency, table);
+    }
+    
+    /**
+     *  number of quantization steps a code table is stored with: 1 if every leaf
+     *  coordinate has the same step
+     */
+    uint64 stored_precision_num(const leaf_code_table &table) {
+        const std::vector<float32> &precision = table.quantization_precision;
+        for (auto step: precision) {
+            if (step != precision[0]) return precision.size();
+        }
+        return 1;
+    }
+    
+    /**
+     *  range [first, first + num) of the symbols of a code table, num = 0 if empty
+     */
+    void code_range(const codetable &ctbl, int32 &first, uint64 &num) {
+        first = 0;
+        num = 0;
+        if (ctbl.empty()) return;
+        int32 last = ctbl.begin()->first;
+        first = last;
+        for (auto &it: ctbl) {
+            first = std::min<int32>(first, it.first);
+            last = std::max<int32>(last, it.first);
+        }
+        num = static_cast<uint64>(static_cast<int64>(last) - first) + 1;
+    }
+    
+    /**
+     *  Huffman codes: ctbl size, then (value, code_size, code) per symbol. Canonical
+     *  codes are the uint64 number of values from the smallest symbol to the largest,
+     *  and if it is not 0 the int32 smallest symbol followed by the uint8 code length
+     *  of every value, 0 for values without a code.
+     */
+    uint64 codes_size(const codetable &ctbl, bool canonical) {
+        if (canonical) {
+            int32 first;
+            uint64 num;
+            code_range(ctbl, first, num);
+            return sizeof(uint64) + (num ? sizeof(int32) + num * sizeof(uint8) : 0);
+        }
+        uint64 size = sizeof(uint64);
+        for (auto &it: ctbl) {
+            // value + code_size + code_t
+            size += sizeof(int) + sizeof(uint8) + (it.second.size() + 7) / 8;
+        }
+        return size;
+    }
+    
+    void write_codes(std::ostream &os, const codetable &ctbl, bool canonical) {
+        if (canonical) {
+            int32 first;
+            uint64 num;
+            code_range(ctbl, first, num);
+            write_single_value(os, num);
+            if (num == 0) return;
+            write_single_value(os, first);
+            std::vector<uint8> lengths(num, 0);
+            for (auto &it: ctbl) lengths[it.first - first] = static_cast<uint8>(it.second.size());
+            os.write(reinterpret_cast<const char *>(lengths.data()), lengths.size());
+            return;
+        }
+        uint64 ctbl_size = ctbl.size();
+        write_single_value(os, ctbl_size);
+        
+        // code table content
+        for (auto it: ctbl) {
+            int k = it.first;
+            std::vector<bool> bits = it.second;
+            uint8 bits_num = static_cast<uint8>(bits.size());
+            std::vector<char> data;
+            bits_to_chars(bits, data);
+            write_single_value(os, k);
+            write_single_value(os, bits_num);
+            write_char_vec(os, data);
+        }
+    }
+    
+    /**
+     *  size of a code table in the code table section
+     *
+     *  With MODEL_FLAG_LEVEL_CODE_TABLES every table starts with a uint64 precision_num,
+     *  1 or the number of leaf coordinates, followed by that many float32 steps. Otherwise
+     *  there is a single table that starts with one float32 step. A tANS table stores a
+     *  uint8 table_log, the uint64 number of symbols and (int32 value, uint16 frequency)
+     *  per symbol where a Huffman table stores its codes.
+     */
+    uint64 leaf_code_table_size(const leaf_code_table &table, bool level_code_tables) {
+        uint64 size = 0;
+        if (level_code_tables) {
+            size += sizeof(uint64) + stored_precision_num(table) * sizeof(float32);
+        } else {
+            size += sizeof(float32);
+        }
+        if (table.tans) {
+            // table_log, number of symbols, (value, frequency) per symbol
+            size += sizeof(uint8) + sizeof(uint64) + table.tans_table.frequencies.size() * (sizeof(int32) + sizeof(uint16));
+        } else {
+            size += codes_size(table.ctbl, table.canonical);
+        }
+        if (table.zero_run) size += sizeof(int32);
+        return size;
+    }
+    
+    void write_leaf_code_table(std::ostream &os, const leaf_code_table &table, bool level_code_tables) {
+        const std::vector<float32> &precision = table.quantization_precision;
+        if (level_code_tables) {
+            uint64 precision_num = stored_precision_num(table);
+            write_single_value(os, precision_num);
+            for (uint64 idx = 0; idx < precision_num; ++ idx) {
+                write_single_value(os, precision[idx]);
+            }
+        } else {
+            write_single_value(os, precision[0]);
+        }
+        if (table.tans) {
+            write_single_value(os, static_cast<uint8>(table.tans_table.table_log));
+            uint64 symbol_num = table.tans_table.frequencies.size();
+            write_single_value(os, symbol_num);
+            for (auto &it: table.tans_table.frequencies) {
+                write_single_value(os, static_cast<int32>(it.first));
+                write_single_value(os, static_cast<uint16>(it.second));
+            }
+            if (table.zero_run) write_single_value(os, table.zero_run_base);
+            return;
+        }
+        write_codes(os, table.ctbl, table.canonical);
+        if (table.zero_run) write_single_value(os, table.zero_run_base);
+    }
+    
+    /**
+     *  writes a MSB-first bit stream to an output stream through a 64-bit
+     *  accumulator. flush() pads the last byte with zero bits.
+     */
+    class bit_writer {
+    public:
+        explicit bit_writer(std::ostream &os) : os_(os), buf_(0), count_(0), size_(0), bits_(0) {}
+        
+        ~bit_writer() {
+            flush();
+        }
+        
+        // append the n (<= 32) low bits of v
+        inline void write(uint32 v, unsigned int n) {
+            buf_ = (buf_ << n) | (v & ((static_cast<uint64>(1) << n) - 1));
+            count_ += n;
+            bits_ += n;
+            while (count_ >= 8) {
+                count_ -= 8;
+                bytes_[size_ ++] = static_cast<char>(buf_ >> count_);
+                if (size_ == sizeof(bytes_)) flush_bytes();
+            }
+        }
+        
+        // append a right-aligned code of up to 64 bits
+        inline void write_code(uint64 code, unsigned int n) {
+            if (n > 32) {
+                write(static_cast<uint32>(code >> 32), n - 32);
+                n = 32;
+            }
+            write(static_cast<uint32>(code), n);
+        }
+        
+        void flush() {
+            if (count_ > 0) write(0, 8 - count_);
+            flush_bytes();
+        }
+        
+        // number of bits written so far, without padding
+        uint64 tell() const {
+            return bits_;
+        }
+        
+    private:
+        void flush_bytes() {
+            os_.write(bytes_, size_);
+            size_ = 0;
+        }
+        
+        std::ostream &os_;
+        uint64 buf_;
+        unsigned int count_;
+        unsigned int size_;
+        uint64 bits_;
+        char bytes_[4096];
+    };
+    
+    // a bit_writer that writes nothing, for counting the bits of encode_tans_block
+    struct null_bit_writer {
+        inline void write(uint32, unsigned int) {}
+    };
+    
+    /**
+     *  bits of an index into n entries, ceil(log2(n)) and at least 1
+     */
+    inline unsigned int index_bits(uint64 n) {
+        unsigned int bits = 1;
+        while ((1ull << bits) < n) ++ bits;
+        return bits;
+    }
+    
     /**
-     *  compress shape predictor model
+     *  writes packed splits as a coded splits section: the uint8 split_index_bits, the
+     *  Huffman codes of the thresholds (see write_codes), and a bit stream with idx1 and
+     *  idx2 in split_index_bits each followed by the threshold code, per split in the
+     *  order of the packed splits. Returns the size of the section with its length.
+     */
+    uint64 write_coded_splits(std::ostream &os, const std::vector<uint32> &splits, uint64 feature_pool_size, bool canonical) {
+        const unsigned int split_index_bits = index_bits(feature_pool_size);
+        std::unordered_map<int, unsigned long> frequency;
+        for (uint32 split: splits) ++ frequency[packed_split_thresh(split)];
+        const codetable ctbl = build_code_table(frequency);
+        const HuffmanEncodeTable etbl = build_encode_table(ctbl);
+        
+        uint64 bits_num = 0;
+        for (auto &it: frequency) bits_num += it.second * (2 * split_index_bits + etbl.length(it.first));
+        uint64 data_length = sizeof(uint8) + codes_size(ctbl, canonical) + (bits_num + 7) / 8;
+        write_single_value(os, data_length);
+        write_single_value(os, static_cast<uint8>(split_index_bits));
+        write_codes(os, ctbl, canonical);
+        
+        bit_writer writer(os);
+        for (uint32 split: splits) {
+            const int32 thresh = packed_split_thresh(split);
+            writer.write(static_cast<uint32>(packed_split_idx1(split)), split_index_bits);
+            writer.write(static_cast<uint32>(packed_split_idx2(split)), split_index_bits);
+            writer.write_code(etbl.code(thresh), etbl.length(thresh));
+        }
+        writer.flush();
+        return sizeof(uint64) + data_length;
+    }
+    
+    /**
+     *  writes the leaf rows section: the uint64 codebook size, followed by a bit stream
+     *  with the codebook row of every tree leaf of every level in index_bits(codebook
+     *  size) bits each. Returns the size of the section with its length.
+     */
+    uint64 write_leaf_rows(std::ostream &os, const std::vector<uint32> &rows, uint64 codebook_size) {
+        const unsigned int row_bits = index_bits(codebook_size);
+        uint64 data_length = sizeof(uint64) + (rows.size() * row_bits + 7) / 8;
+        write_single_value(os, data_length);
+        write_single_value(os, codebook_size);
+        bit_writer writer(os);
+        for (uint32 row: rows) writer.write(row, row_bits);
+        writer.flush();
+        return sizeof(uint64) + data_length;
+    }
+    
+    /**
+     *  compress shape predictor model. sp is left as it is: leaf values are pruned
+     *  while they are quantized.
      */
     void save_shape_predictor_model(
-        dlib::shape_predictor &sp,
-        const std::string &save_path,
-        const float _prune_thresh=0.0001,
-        const unsigned long long _quantization_num=512,
-        const unsigned long long _version=0) {
+        const dlib::shape_predictor &sp,
+        std::ostream &os,
+        const compression_options &options,
+        model_stats *stats=NULL) {
         
         using namespace std;
-        std::ofstream os(save_path, std::ofstream::binary);
+        stage_recorder recorder(stats);
+        if (options.version > MODEL_VERSION_LATEST) throw dlib::error("Unsupported compressed model version.");
+        if (options.version == 0 && options.quantizer != QUANTIZER_MODEL) throw dlib::error("Version 0 models only support QUANTIZER_MODEL.");
+        if (options.version == 0 && options.packed_splits) throw dlib::error("Version 0 models do not support packed splits.");
+        if (options.version == 0 && options.coded_splits) throw dlib::error("Version 0 models do not support coded splits.");
+        if (options.version == 0 && options.leaf_codebook_size) throw dlib::error("Version 0 models do not support leaf codebooks.");
+        if (options.leaf_codebook_size > LEAF_CODEBOOK_MAX_SIZE) throw dlib::error("Leaf codebook too large.");
+        if ((options.packed_splits || options.coded_splits) && sp.anchor_idx[0].size() > PACKED_SPLIT_MAX_FEATURES) {
+            throw dlib::error("Feature pool too large for packed splits.");
+        }
         
         /**
          *  const value
          */
-        const uint64 version = _version;
+        const uint64 version = options.version;
         const uint64 cascade_depth = sp.forests.size();
         const uint64 num_trees_per_cascade_level = sp.forests[0].size();
         const uint64 num_leaves = sp.forests[0][0].num_leaves();
         const uint64 tree_depth = static_cast<uint64>(std::log(num_leaves) / std::log(2));
         const uint64 feature_pool_size = sp.anchor_idx[0].size();
         const uint64 landmark_num = sp.initial_shape.size() / 2;
-        const uint64 quantization_num = _quantization_num;
-        const float32 prune_thresh = _prune_thresh;
+        const uint64 quantization_num = options.quantization_num;
+        const float32 prune_thresh = options.prune_thresh;
+        const bool zero_run = version >= 1 && options.zero_run;
+        const bool tans = version >= MODEL_VERSION_TANS;
+        // version 0 has no flags and stores every code
+        const bool canonical = version >= 1;
+        const bool leaf_codebook = options.leaf_codebook_size > 0;
+        // a codebook is decoded as a whole, so every level is a single block
+        const uint64 index_block_trees = leaf_codebook ? num_trees_per_cascade_level :
+            std::max<uint64>(1, std::min<uint64>(options.index_block_trees, num_trees_per_cascade_level));
+        
+        /**
+         *  leaf values are quantized and their code tables built before anything is
+         *  written, since the flags in the header depend on the code tables
+         */
+        
+        /*** step 1 value ranges, the leaves are pruned as they are quantized ***/
+        float leaf_min_value = 100000., leaf_max_value = -100000.;
+        const unsigned long leaf_value_num = landmark_num * 2;
+        // range of every leaf coordinate of every level, 0 included
+        vector<vector<float> > coord_min_value(cascade_depth, vector<float>(leaf_value_num, 0.));
+        vector<vector<float> > coord_max_value(cascade_depth, vector<float>(leaf_value_num, 0.));
+        for (int r = 0; r < cascade_depth; ++ r) {
+            for (int c = 0; c < num_trees_per_cascade_level; ++ c) {
+                for (auto &leaf_value: sp.forests[r][c].leaf_values) {
+                    for (int idx = 0; idx < leaf_value_num; ++ idx) {
+                        float v = leaf_value(idx);
+                        if (v > leaf_max_value) leaf_max_value = v;
+                        if (v < leaf_min_value) leaf_min_value = v;
+                        coord_max_value[r][idx] = std::max(coord_max_value[r][idx], v);
+                        coord_min_value[r][idx] = std::min(coord_min_value[r][idx], v);
+                    }
+                }
+            }
+        }
+        
+        /*** step1b leaf codebook ***/
+        // the leaf vectors coded for every level: the leaves of its trees in order, or the
+        // rows of its codebook
+        vector<vector<const dlib::matrix<float,0,1> *> > coded_leaves(cascade_depth);
+        for (int r = 0; r < cascade_depth; ++ r) {
+            for (int c = 0; c < num_trees_per_cascade_level; ++ c) {
+                for (auto &leaf_value: sp.forests[r][c].leaf_values) coded_leaves[r].push_back(&leaf_value);
+            }
+        }
+        vector<vector<dlib::matrix<float,0,1> > > codebooks(cascade_depth);
+        vector<uint32> leaf_rows;
+        if (leaf_codebook) {
+            vector<uint32> rows;
+            for (int r = 0; r < cascade_depth; ++ r) {
+                cluster_leaves(coded_leaves[r], prune_thresh, options.leaf_codebook_size, options.codebook_iterations, codebooks[r], rows, options.num_threads);
+                leaf_rows.insert(leaf_rows.end(), rows.begin(), rows.end());
+                coded_leaves[r].clear();
+                for (auto &row: codebooks[r]) coded_leaves[r].push_back(&row);
+            }
+            recorder.record("leaf_codebook", 0);
+        }
+        const uint64 codebook_size = leaf_codebook ? codebooks[0].size() : 0;
+        // leaf vectors per block of the leaf index
+        const uint64 block_leaves = leaf_codebook ? codebook_size : index_block_trees * num_leaves;
+        
+        /*** step2 quantization ***/
+        vector<vector<float32> > quantization_precision(cascade_depth, vector<float32>(leaf_value_num));
+        for (int r = 0; r < cascade_depth; ++ r) {
+            const float level_min_value = *std::min_element(coord_min_value[r].begin(), coord_min_value[r].end());
+            const float level_max_value = *std::max_element(coord_max_value[r].begin(), coord_max_value[r].end());
+            for (int idx = 0; idx < leaf_value_num; ++ idx) {
+                float32 precision = (leaf_max_value - leaf_min_value) / quantization_num;
+                if (options.quantizer == QUANTIZER_LEVEL) {
+                    precision = (level_max_value - level_min_value) / quantization_num;
+                } else if (options.quantizer == QUANTIZER_COORDINATE) {
+                    precision = (coord_max_value[r][idx] - coord_min_value[r][idx]) / quantization_num;
+                }
+                // every value is 0, any step will do
+                if (!(precision > 0)) precision = 1.;
+                quantization_precision[r][idx] = precision;
+            }
+        }
+        
+        // count frequency of the quantization values and the zero run lengths of every level
+        vector<unordered_map<int, unsigned long> > value_frequency(cascade_depth);
+        vector<unordered_map<int, unsigned long> > run_frequency(cascade_depth);
+        vector<int> symbols;
+        
+        for (int r = 0; r < cascade_depth; ++ r) {
+            for (auto leaf_value: coded_leaves[r]) {
+                quantize_leaf(*leaf_value, quantization_precision[r], prune_thresh, false, 0, symbols);
+                int run = 0;
+                for (int symbol: symbols) {
+                    ++ value_frequency[r][symbol];
+                    if (symbol == 0) {
+                        ++ run;
+                        continue;
+                    }
+                    if (run) ++ run_frequency[r][run];
+                    run = 0;
+                }
+                if (run) ++ run_frequency[r][run];
+            }
+        }
+        
+        /*** step3 huffman or tANS code tables ***/
+        
+        // one code table for the whole model
+        vector<leaf_code_table> tables;
+        uint64 model_bits = 0;
+        if (options.quantizer == QUANTIZER_MODEL) {
+            unordered_map<int, unsigned long> model_value_frequency, model_run_frequency;
+            for (int r = 0; r < cascade_depth; ++ r) {
+                for (auto &it: value_frequency[r]) model_value_frequency[it.first] += it.second;
+                for (auto &it: run_frequency[r]) model_run_frequency[it.first] += it.second;
+            }
+            tables.resize(1);
+            tables[0].quantization_precision = quantization_precision[0];
+            tables[0].tans = tans;
+            tables[0].canonical = canonical;
+            model_bits = build_leaf_code_table(model_value_frequency, model_run_frequency, zero_run, tables[0]);
+            model_bits += 8 * leaf_code_table_size(tables[0], false);
+        }
+        
+        // or one per level, which fits the narrower distribution of the late levels better
+        // but stores more tables
+        bool level_code_tables = false;
+        if (version >= 1 && (options.quantizer != QUANTIZER_MODEL || options.level_code_tables)) {
+            vector<leaf_code_table> level_tables(cascade_depth);
+            uint64 level_bits = 0;
+            for (int r = 0; r < cascade_depth; ++ r) {
+                level_tables[r].quantization_precision = quantization_precision[r];
+                level_tables[r].tans = tans;
+                level_tables[r].canonical = canonical;
+                level_bits += build_leaf_code_table(value_frequency[r], run_frequency[r], zero_run, level_tables[r]);
+                level_bits += 8 * leaf_code_table_size(level_tables[r], true);
+            }
+            if (tables.empty() || level_bits < model_bits) {
+                tables.swap(level_tables);
+                level_code_tables = true;
+            }
+        }
+        
+        uint64 flags = 0;
+        if (version >= 1) flags |= MODEL_FLAG_LEAF_INDEX;
+        if (zero_run) flags |= MODEL_FLAG_ZERO_RUN;
+        if (level_code_tables) flags |= MODEL_FLAG_LEVEL_CODE_TABLES;
+        if (options.packed_splits || options.coded_splits) flags |= MODEL_FLAG_PACKED_SPLITS;
+        if (options.coded_splits) flags |= MODEL_FLAG_CODED_SPLITS;
+        if (leaf_codebook) flags |= MODEL_FLAG_LEAF_CODEBOOK;
+        if (canonical) flags |= MODEL_FLAG_CANONICAL_CODES;
+        recorder.record("leaf_coding", 0);
         
         
         /**
          *  save const value
          */
         unsigned long long data_length = 7 * sizeof(uint64) + sizeof(float32);
+        if (version >= 1) data_length += sizeof(uint64);
         write_single_value(os, data_length);
         write_single_value(os, version);
         write_single_value(os, cascade_depth);
@@ -125,6 +1077,8 @@ namespace med {
         write_single_value(os, landmark_num);
         write_single_value(os, quantization_num);
         write_single_value(os, prune_thresh);
+        if (version >= 1) write_single_value(os, flags);
+        recorder.record("header", sizeof(uint64) + data_length);
         
         /**
          *  initial_shape
@@ -136,6 +1090,7 @@ namespace med {
             auto data = static_cast<float32>(*it);
             write_single_value(os, data);
         }
+        recorder.record("initial_shape", sizeof(uint64) + data_length);
         
         /**
          *  anchor_idx
@@ -149,6 +1104,7 @@ namespace med {
                 write_single_value(os, idx);
             }
         }
+        recorder.record("anchor_idx", sizeof(uint64) + data_length);
         
         /**
          *  deltas
@@ -161,6 +1117,7 @@ namespace med {
                 write_single_value(os, static_cast<float32>(sp.deltas[r][c](1)));
             }
         }
+        recorder.record("deltas", sizeof(uint64) + data_length);
         
         /**
          *  forests
@@ -169,134 +1126,266 @@ namespace med {
         /**
          *  splits
          */
-        data_length = cascade_depth * num_trees_per_cascade_level * (num_leaves - 1) * (sizeof(uint16) + sizeof(uint16) + sizeof(float32));
-        write_single_value(os, data_length);
-        for (int r = 0; r < cascade_depth; ++ r) {
-            for (int c = 0; c < num_trees_per_cascade_level; ++ c) {
-                auto &tree = sp.forests[r][c];
-                auto &splits = tree.splits;
-                
-                for (auto &split: splits) {
-                    uint16 idx1 = static_cast<uint16>(split.idx1);
-                    uint16 idx2 = static_cast<uint16>(split.idx2);
-                    float32 thresh = static_cast<float32>(split.thresh);
-                    write_single_value(os, idx1);
-                    write_single_value(os, idx2);
-                    write_single_value(os, thresh);
+        if (options.coded_splits) {
+            vector<uint32> packed_splits;
+            for (int r = 0; r < cascade_depth; ++ r) {
+                for (int c = 0; c < num_trees_per_cascade_level; ++ c) {
+                    for (auto &split: sp.forests[r][c].splits) {
+                        packed_splits.push_back(pack_split(split.idx1, split.idx2, packed_split_threshold(split.thresh)));
+                    }
+                }
+            }
+            recorder.record("splits", write_coded_splits(os, packed_splits, feature_pool_size, canonical));
+        } else {
+            const uint64 split_size = options.packed_splits ? sizeof(uint32) : sizeof(uint16) + sizeof(uint16) + sizeof(float32);
+            data_length = cascade_depth * num_trees_per_cascade_level * (num_leaves - 1) * split_size;
+            write_single_value(os, data_length);
+            for (int r = 0; r < cascade_depth; ++ r) {
+                for (int c = 0; c < num_trees_per_cascade_level; ++ c) {
+                    auto &tree = sp.forests[r][c];
+                    auto &splits = tree.splits;
+                    
+                    for (auto &split: splits) {
+                        if (options.packed_splits) {
+                            write_single_value(os, pack_split(split.idx1, split.idx2, packed_split_threshold(split.thresh)));
+                            continue;
+                        }
+                        uint16 idx1 = static_cast<uint16>(split.idx1);
+                        uint16 idx2 = static_cast<uint16>(split.idx2);
+                        float32 thresh = static_cast<float32>(split.thresh);
+                        write_single_value(os, idx1);
+                        write_single_value(os, idx2);
+                        write_single_value(os, thresh);
+                    }
                 }
             }
+            recorder.record("splits", sizeof(uint64) + data_length);
         }
         
         /**
          *  leaf values
          */
         
-        /*** step 1 prune ***/
-        float leaf_min_value = 100000., leaf_max_value = -100000.;
-        const unsigned long leaf_value_num = landmark_num * 2;
+        /*** step4 save the code tables ***/
+        
+        data_length = 0;
+        for (auto &table: tables) {
+            data_length += leaf_code_table_size(table, level_code_tables);
+        }
+        write_single_value(os, data_length);
+        for (auto &table: tables) {
+            write_leaf_code_table(os, table, level_code_tables);
+        }
+        recorder.record("code_table", sizeof(uint64) + data_length);
+        
+        // a table that codes zero runs has no code for single zero values
+        vector<HuffmanEncodeTable> etbls;
+        vector<bool> use_zero_run;
+        for (auto &table: tables) {
+            if (!tans) etbls.push_back(build_encode_table(table.ctbl));
+            use_zero_run.push_back(table.zero_run && !table.has_code(0));
+        }
+        
+        // symbols of the block of coded leaves of level r that starts at begin
+        vector<int> block_symbols;
+        auto quantize_block = [&](int r, uint64 begin) {
+            const uint64 t = level_code_tables ? r : 0;
+            const uint64 end = std::min<uint64>(begin + block_leaves, coded_leaves[r].size());
+            block_symbols.clear();
+            for (uint64 idx = begin; idx < end; ++ idx) {
+                quantize_leaf(*coded_leaves[r][idx], quantization_precision[r], prune_thresh, use_zero_run[t], tables[t].zero_run_base, symbols);
+                block_symbols.insert(block_symbols.end(), symbols.begin(), symbols.end());
+            }
+        };
+        
+        /*** step5 block offsets and stream length ***/
+        vector<uint64> block_bit_offsets;
+        uint64 bits_num = 0;
         for (int r = 0; r < cascade_depth; ++ r) {
-            for (int c = 0; c < num_trees_per_cascade_level; ++ c) {
-                auto &tree = sp.forests[r][c];
-                auto &leaf_values = tree.leaf_values;
-                for (auto &leaf_value: leaf_values) {
-                    for (int idx = 0; idx < leaf_value_num; ++ idx) {
-                        float v = leaf_value(idx);
-                        if (v > leaf_max_value) leaf_max_value = v;
-                        if (v < leaf_min_value) leaf_min_value = v;
-                        if (std::fabs(v) < prune_thresh) leaf_value(idx) = 0.;
-                    }
+            const uint64 t = level_code_tables ? r : 0;
+            for (uint64 begin = 0; begin < coded_leaves[r].size(); begin += block_leaves) {
+                block_bit_offsets.push_back(bits_num);
+                quantize_block(r, begin);
+                if (tans) {
+                    null_bit_writer counter;
+                    bits_num += encode_tans_block(tables[t].tans_table, block_symbols, counter);
+                    continue;
+                }
+                for (int symbol: block_symbols) {
+                    bits_num += etbls[t].length(symbol);
                 }
             }
         }
         
-        /*** step2 quantization ***/
-        float32 quantization_precision = (leaf_max_value - leaf_min_value) / quantization_num;
+        /*** step6 leaf index ***/
+        if (flags & MODEL_FLAG_LEAF_INDEX) {
+            data_length = 2 * sizeof(uint64) + block_bit_offsets.size() * sizeof(uint64);
+            write_single_value(os, data_length);
+            write_single_value(os, index_block_trees);
+            uint64 num_blocks = block_bit_offsets.size();
+            write_single_value(os, num_blocks);
+            for (auto offset: block_bit_offsets) {
+                write_single_value(os, offset);
+            }
+            recorder.record("leaf_index", sizeof(uint64) + data_length);
+        }
         
-        unordered_map<int, unsigned long> quantization_frequency;   // count frequency
+        /*** step7 encode ***/
+        data_length = (bits_num + 7) / 8;
+        write_single_value(os, data_length);
         
+        bit_writer writer(os);
         for (int r = 0; r < cascade_depth; ++ r) {
-            for (int c = 0; c < num_trees_per_cascade_level; ++ c) {
-                auto &tree = sp.forests[r][c];
-                auto &leaf_values = tree.leaf_values;
-                for (auto &leaf_value: leaf_values) {
-                    for (int idx = 0; idx < leaf_value_num; ++ idx) {
-                        int quantization_value = static_cast<int>(std::round(leaf_value(idx) / quantization_precision));
-                        ++ quantization_frequency[quantization_value];
-                    }
+            const uint64 t = level_code_tables ? r : 0;
+            for (uint64 begin = 0; begin < coded_leaves[r].size(); begin += block_leaves) {
+                quantize_block(r, begin);
+                if (tans) {
+                    encode_tans_block(tables[t].tans_table, block_symbols, writer);
+                    continue;
+                }
+                for (int symbol: block_symbols) {
+                    writer.write_code(etbls[t].code(symbol), etbls[t].length(symbol));
                 }
             }
         }
+        writer.flush();
+        recorder.record("leaf_values", sizeof(uint64) + data_length);
         
-        /*** step3 huffman ***/
-        
-        vector<pair<int, unsigned long> >cfvec(quantization_frequency.begin(), quantization_frequency.end());
-        
-        HuffmanTree *htree = build_tree(cfvec);
-        codetable ctbl = build_lookup_table(htree);
+        /*** step8 codebook rows of the leaves ***/
+        if (leaf_codebook) recorder.record("leaf_rows", write_leaf_rows(os, leaf_rows, codebook_size));
+    }
+    
+    void save_shape_predictor_model(
+        const dlib::shape_predictor &sp,
+        const std::string &save_path,
+        const compression_options &options,
+        model_stats *stats=NULL) {
         
-        destroy_tree(htree);
-        htree = NULL;
+        std::ofstream os(save_path, std::ofstream::binary);
+        save_shape_predictor_model(sp, os, options, stats);
+    }
+    
+    /**
+     *  the original interface, which keeps writing version 0 models that every loader
+     *  reads. Newer formats are chosen through compression_options.
+     */
+    void save_shape_predictor_model(
+        const dlib::shape_predictor &sp,
+        const std::string &save_path,
+        const float _prune_thresh=0.0001,
+        const unsigned long long _quantization_num=512,
+        const unsigned long long _version=0) {
         
-        /*** step4 save the code table ***/
+        compression_options options;
+        options.prune_thresh = _prune_thresh;
+        options.quantization_num = _quantization_num;
+        options.version = _version;
+        save_shape_predictor_model(sp, save_path, options);
+    }
+    
+    /**
+     *  read-only memory mapping of a whole file. Worker processes that map the same
+     *  model share its page-cache pages instead of each holding a private copy.
+     */
+    class mapped_file {
+    public:
+        mapped_file() : data_(NULL), size_(0) {}
         
-        data_length = sizeof(float32) + sizeof(uint64);    //quantization_precision + ctbl size
-        for (auto it: ctbl) {
-            // value + code_size + code_t
-            data_length += sizeof(int) + sizeof(uint8) + (it.second.size() + 7) / 8;
+        explicit mapped_file(const std::string &filename) : data_(NULL), size_(0) {
+            open(filename);
         }
-        write_single_value(os, data_length);
-        write_single_value(os, quantization_precision);
-        uint64 ctbl_size = ctbl.size();
-        write_single_value(os, ctbl_size);
         
-        // code table content
-        for (auto it: ctbl) {
-            int k = it.first;
-            vector<bool> bits = it.second;
-            uint8 bits_num = static_cast<uint8>(bits.size());
-            std::vector<char> data;
-            bits_to_chars(bits, data);
-            write_single_value(os, k);
-            write_single_value(os, bits_num);
-            write_char_vec(os, data);
+        ~mapped_file() {
+            close();
         }
         
-        /*** step5 encode ***/
-        vector<bool> encode_data_bin;
-        for (int r = 0; r < cascade_depth; ++ r) {
-            for (int c = 0; c < num_trees_per_cascade_level; ++ c) {
-                auto &tree = sp.forests[r][c];
-                auto &leaf_values = tree.leaf_values;
-                for (auto &leaf_value: leaf_values) {
-                    for (int idx = 0; idx < leaf_value_num; ++ idx) {
-                        int quantization_value = static_cast<int>(std::round(leaf_value(idx) / quantization_precision));
-                        auto code = ctbl[quantization_value];
-                        encode_data_bin.insert(encode_data_bin.end(), code.begin(), code.end());
-                    }
+        void open(const std::string &filename) {
+            close();
+#if defined(_WIN32)
+            std::ifstream is(filename, std::ifstream::binary);
+            if (!is) throw dlib::serialization_error("Unable to open " + filename + " for reading.");
+            buffer_.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+            data_ = buffer_.empty() ? NULL : &buffer_[0];
+            size_ = buffer_.size();
+#else
+            int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0) throw dlib::serialization_error("Unable to open " + filename + " for reading.");
+            struct stat st;
+            if (::fstat(fd, &st) != 0) {
+                ::close(fd);
+                throw dlib::serialization_error("Unable to stat " + filename);
+            }
+            size_ = static_cast<uint64>(st.st_size);
+            if (size_ > 0) {
+                void *addr = ::mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+                if (addr == MAP_FAILED) {
+                    ::close(fd);
+                    size_ = 0;
+                    throw dlib::serialization_error("Unable to map " + filename);
                 }
+                data_ = static_cast<const char *>(addr);
             }
+            ::close(fd);
+#endif
         }
         
-        std::vector<char> encode_data;
-        bits_to_chars(encode_data_bin, encode_data);
+        void close() {
+#if defined(_WIN32)
+            std::vector<char>().swap(buffer_);
+#else
+            if (data_) ::munmap(const_cast<char *>(data_), size_);
+#endif
+            data_ = NULL;
+            size_ = 0;
+        }
         
-        data_length = encode_data.size();
-        write_single_value(os, data_length);
-        write_char_vec(os, encode_data);
-    }
+        const char *data() const { return data_; }
+        uint64 size() const { return size_; }
+        
+    private:
+        mapped_file(const mapped_file &);
+        mapped_file &operator=(const mapped_file &);
+        
+        const char *data_;
+        uint64 size_;
+#if defined(_WIN32)
+        std::vector<char> buffer_;
+#endif
+    };
     
     /**
-     *  load a compressed shape predictor model
+     *  layout of a compressed model
+     *
+     *  The file is a sequence of sections, each one a uint64 data_length followed by
+     *  data_length bytes: header, initial_shape, anchor_idx, deltas, splits, code
+     *  tables and leaf values. A model_layout points into the bytes of a loaded or
+     *  mapped file and does not own them.
      */
-    void load_shape_predictor_model(dlib::shape_predictor &sp, const std::string&filename) {
-        
-        using namespace std;
-        std::ifstream is(filename, std::ofstream::binary);
-        
-        /**
-         *  constant values
-         */
-        uint64 data_length;
+    struct byte_view {
+        const char *data;
+        uint64 size;
+    };
+    
+    /**
+     *  64-bit FNV-1a hash of a byte range
+     */
+    inline uint64 fnv1a_hash(const char *data, uint64 size) {
+        uint64 hash = 14695981039346656037ull;
+        for (uint64 idx = 0; idx < size; ++ idx) {
+            hash ^= static_cast<uint8>(data[idx]);
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+    
+    template <typename T>
+    inline T load_value(const char *p) {
+        T data;
+        std::memcpy(&data, p, sizeof(T));
+        return data;
+    }
+    
+    struct model_header {
         uint64 version;
         uint64 cascade_depth;
         uint64 num_trees_per_cascade_level;
@@ -305,68 +1394,483 @@ namespace med {
         uint64 landmark_num;
         uint64 quantization_num;
         float32 prune_thresh;
+        uint64 flags;
+        
+        uint64 num_leaves() const { return 1ull << tree_depth; }
+        uint64 num_splits() const { return num_leaves() - 1; }
+        uint64 leaf_value_num() const { return landmark_num * 2; }
+        uint64 split_size() const { return (flags & MODEL_FLAG_PACKED_SPLITS) ? sizeof(uint32) : 8; }
+    };
+    
+    struct model_layout {
+        model_header header;
+        byte_view initial_shape;
+        byte_view anchor_idx;
+        byte_view deltas;
+        byte_view splits;
+        byte_view code_table;
+        byte_view leaf_index;
+        byte_view leaf_values;
+        byte_view leaf_rows;
+        
+        // trees per block of the leaf index, 0 if the leaf stream has no index
+        uint64 index_block_trees;
+        uint64 num_index_blocks;
+        // rows of the codebook of every level, 0 if the leaf values are not a codebook
+        uint64 codebook_size;
+        
+        uint64 blocks_per_level() const {
+            return (header.num_trees_per_cascade_level + index_block_trees - 1) / index_block_trees;
+        }
+        
+        // leaf vectors coded in the leaf stream per level
+        uint64 level_vector_num() const {
+            return codebook_size ? codebook_size : header.num_trees_per_cascade_level * header.num_leaves();
+        }
+        
+        uint64 block_bit_offset(uint64 block) const {
+            return load_value<uint64>(leaf_index.data + (2 + block) * sizeof(uint64));
+        }
+    };
+    
+    std::vector<byte_view> split_sections(const char *data, uint64 size) {
+        std::vector<byte_view> sections;
+        uint64 offset = 0;
+        while (offset < size) {
+            if (size - offset < sizeof(uint64)) throw dlib::serialization_error("Truncated section header in compressed model.");
+            byte_view view;
+            view.size = load_value<uint64>(data + offset);
+            offset += sizeof(uint64);
+            if (view.size > size - offset) throw dlib::serialization_error("Truncated section in compressed model.");
+            view.data = data + offset;
+            offset += view.size;
+            sections.push_back(view);
+        }
+        return sections;
+    }
+    
+    void parse_model_layout(const std::vector<byte_view> &sections, model_layout &layout) {
+        if (sections.empty()) throw dlib::serialization_error("Missing sections in compressed model.");
+        
+        const byte_view &h = sections[0];
+        if (h.size < 7 * sizeof(uint64) + sizeof(float32)) throw dlib::serialization_error("Invalid compressed model header.");
+        model_header &header = layout.header;
+        header.version = load_value<uint64>(h.data);
+        header.cascade_depth = load_value<uint64>(h.data + 8);
+        header.num_trees_per_cascade_level = load_value<uint64>(h.data + 16);
+        header.tree_depth = load_value<uint64>(h.data + 24);
+        header.feature_pool_size = load_value<uint64>(h.data + 32);
+        header.landmark_num = load_value<uint64>(h.data + 40);
+        header.quantization_num = load_value<uint64>(h.data + 48);
+        header.prune_thresh = load_value<float32>(h.data + 56);
+        header.flags = 0;
+        if (header.version > MODEL_VERSION_LATEST) throw dlib::serialization_error("Unsupported compressed model version.");
+        if (header.version >= 1) {
+            if (h.size < 8 * sizeof(uint64) + sizeof(float32)) throw dlib::serialization_error("Invalid compressed model header.");
+            header.flags = load_value<uint64>(h.data + 60);
+        }
+        if (header.tree_depth >= 32) throw dlib::serialization_error("Invalid tree depth in compressed model.");
+        if ((header.flags & MODEL_FLAG_CODED_SPLITS) && !(header.flags & MODEL_FLAG_PACKED_SPLITS)) {
+            throw dlib::serialization_error("Invalid flags in compressed model.");
+        }
+        // tANS streams restart at every block, so they cannot be read without the index
+        if (header.version >= MODEL_VERSION_TANS && !(header.flags & MODEL_FLAG_LEAF_INDEX)) {
+            throw dlib::serialization_error("Missing leaf index in compressed model.");
+        }
+        
+        // a codebook is decoded per level, through the leaf index
+        if ((header.flags & MODEL_FLAG_LEAF_CODEBOOK) && !(header.flags & MODEL_FLAG_LEAF_INDEX)) {
+            throw dlib::serialization_error("Invalid flags in compressed model.");
+        }
+        
+        const uint64 num_sections = 7 + ((header.flags & MODEL_FLAG_LEAF_INDEX) ? 1 : 0) +
+            ((header.flags & MODEL_FLAG_LEAF_CODEBOOK) ? 1 : 0);
+        if (sections.size() < num_sections) throw dlib::serialization_error("Missing sections in compressed model.");
+        
+        unsigned long section = 1;
+        layout.initial_shape = sections[section ++];
+        layout.anchor_idx = sections[section ++];
+        layout.deltas = sections[section ++];
+        layout.splits = sections[section ++];
+        layout.code_table = sections[section ++];
+        layout.leaf_index.data = NULL;
+        layout.leaf_index.size = 0;
+        layout.index_block_trees = 0;
+        layout.num_index_blocks = 0;
+        if (header.flags & MODEL_FLAG_LEAF_INDEX) {
+            layout.leaf_index = sections[section ++];
+            if (layout.leaf_index.size < 2 * sizeof(uint64)) throw dlib::serialization_error("Invalid leaf index in compressed model.");
+            layout.index_block_trees = load_value<uint64>(layout.leaf_index.data);
+            layout.num_index_blocks = load_value<uint64>(layout.leaf_index.data + sizeof(uint64));
+            if (layout.index_block_trees == 0 ||
+                layout.num_index_blocks != header.cascade_depth * layout.blocks_per_level() ||
+                layout.leaf_index.size < (2 + layout.num_index_blocks) * sizeof(uint64)) {
+                throw dlib::serialization_error("Invalid leaf index in compressed model.");
+            }
+        }
+        layout.leaf_values = sections[section ++];
+        layout.leaf_rows.data = NULL;
+        layout.leaf_rows.size = 0;
+        layout.codebook_size = 0;
+        if (header.flags & MODEL_FLAG_LEAF_CODEBOOK) {
+            layout.leaf_rows = sections[section ++];
+            if (layout.leaf_rows.size < sizeof(uint64)) throw dlib::serialization_error("Invalid leaf rows in compressed model.");
+            layout.codebook_size = load_value<uint64>(layout.leaf_rows.data);
+            const uint64 level_leaves = header.num_trees_per_cascade_level * header.num_leaves();
+            const uint64 rows = header.cascade_depth * level_leaves;
+            if (layout.codebook_size == 0 ||
+                layout.codebook_size > std::min(LEAF_CODEBOOK_MAX_SIZE, level_leaves) ||
+                layout.blocks_per_level() != 1 ||
+                layout.leaf_rows.size < sizeof(uint64) + (rows * index_bits(layout.codebook_size) + 7) / 8) {
+                throw dlib::serialization_error("Invalid leaf rows in compressed model.");
+            }
+        }
+        
+        const uint64 levels = header.cascade_depth;
+        const uint64 trees = levels * header.num_trees_per_cascade_level;
+        if (layout.initial_shape.size < header.leaf_value_num() * sizeof(float32) ||
+            layout.anchor_idx.size < levels * header.feature_pool_size * sizeof(uint8) ||
+            layout.deltas.size < levels * header.feature_pool_size * 2 * sizeof(float32) ||
+            (!(header.flags & MODEL_FLAG_CODED_SPLITS) && layout.splits.size < trees * header.num_splits() * header.split_size())) {
+            throw dlib::serialization_error("Section size does not match the compressed model header.");
+        }
+        
+        // the predictors index the feature pool with the splits without checking them,
+        // coded splits are checked while they are decoded
+        if (header.flags & MODEL_FLAG_CODED_SPLITS) return;
+        const char *split = layout.splits.data;
+        for (uint64 idx = 0; idx < trees * header.num_splits(); ++ idx, split += header.split_size()) {
+            unsigned long idx1, idx2;
+            if (header.flags & MODEL_FLAG_PACKED_SPLITS) {
+                idx1 = packed_split_idx1(load_value<uint32>(split));
+                idx2 = packed_split_idx2(load_value<uint32>(split));
+            } else {
+                idx1 = load_value<uint16>(split);
+                idx2 = load_value<uint16>(split + 2);
+            }
+            if (idx1 >= header.feature_pool_size || idx2 >= header.feature_pool_size) {
+                throw dlib::serialization_error("Invalid splits in compressed model.");
+            }
+        }
+    }
+    
+    void parse_model_layout(const char *data, uint64 size, model_layout &layout) {
+        parse_model_layout(split_sections(data, size), layout);
+    }
+    
+    /**
+     *  Huffman codes written by write_codes
+     */
+    const char *parse_codes(const char *p, const char *end, codetable &ctbl, bool canonical) {
+        if (end - p < static_cast<long>(sizeof(uint64))) throw dlib::serialization_error("Truncated code table in compressed model.");
+        uint64 ctbl_size = load_value<uint64>(p);
+        p += sizeof(uint64);
+        
+        ctbl.clear();
+        if (canonical) {
+            if (ctbl_size == 0) return p;
+            if (end - p < static_cast<long>(sizeof(int32)) || static_cast<uint64>(end - p) - sizeof(int32) < ctbl_size ||
+                ctbl_size > (1ull << 32)) {
+                throw dlib::serialization_error("Truncated code table in compressed model.");
+            }
+            const int32 first = load_value<int32>(p);
+            p += sizeof(int32);
+            if (static_cast<int64>(first) + static_cast<int64>(ctbl_size) - 1 > std::numeric_limits<int32>::max()) {
+                throw dlib::serialization_error("Invalid code table in compressed model.");
+            }
+            std::vector<std::pair<int, unsigned int> > lengths;
+            for (uint64 idx = 0; idx < ctbl_size; ++ idx) {
+                const uint8 length = load_value<uint8>(p + idx);
+                if (length) lengths.push_back(std::make_pair(static_cast<int>(first + idx), static_cast<unsigned int>(length)));
+            }
+            p += ctbl_size;
+            try {
+                ctbl = build_canonical_codes(lengths);
+            } catch (std::invalid_argument &) {
+                throw dlib::serialization_error("Invalid code table in compressed model.");
+            }
+            return p;
+        }
+        ctbl.reserve(std::min<uint64>(ctbl_size, (end - p) / (sizeof(int) + sizeof(uint8))));
+        while (ctbl_size > 0) {
+            if (end - p < static_cast<long>(sizeof(int) + sizeof(uint8))) throw dlib::serialization_error("Truncated code table in compressed model.");
+            int k = load_value<int>(p);
+            p += sizeof(int);
+            uint8 bit_num = load_value<uint8>(p);
+            p += sizeof(uint8);
+            if (end - p < (bit_num + 7) / 8) throw dlib::serialization_error("Truncated code table in compressed model.");
+            chars_to_bits(p, ctbl[k], bit_num);
+            p += (bit_num + 7) / 8;
+            -- ctbl_size;
+        }
+        return p;
+    }
+    
+    /**
+     *  code table section: one code table, or one per cascade level with
+     *  MODEL_FLAG_LEVEL_CODE_TABLES. A table is the quantization step(s), the codes (see
+     *  write_codes, code lengths only with MODEL_FLAG_CANONICAL_CODES), and with
+     *  MODEL_FLAG_ZERO_RUN the int32 zero_run_base. From MODEL_VERSION_TANS on the codes are replaced by the uint8
+     *  table_log, the number of symbols and (value, uint16 frequency) per symbol.
+     */
+    const char *parse_code_table(const char *p, const char *end, const model_header &header, leaf_code_table &table) {
+        const uint64 leaf_value_num = header.leaf_value_num();
+        codetable &ctbl = table.ctbl;
+        if (header.flags & MODEL_FLAG_LEVEL_CODE_TABLES) {
+            if (end - p < static_cast<long>(sizeof(uint64))) throw dlib::serialization_error("Truncated code table in compressed model.");
+            uint64 precision_num = load_value<uint64>(p);
+            p += sizeof(uint64);
+            if (precision_num != 1 && precision_num != leaf_value_num) throw dlib::serialization_error("Invalid code table in compressed model.");
+            if (static_cast<uint64>(end - p) < precision_num * sizeof(float32)) throw dlib::serialization_error("Truncated code table in compressed model.");
+            table.quantization_precision.resize(leaf_value_num);
+            for (uint64 idx = 0; idx < leaf_value_num; ++ idx) {
+                table.quantization_precision[idx] = load_value<float32>(p + (precision_num == 1 ? 0 : idx) * sizeof(float32));
+            }
+            p += precision_num * sizeof(float32);
+        } else {
+            if (end - p < static_cast<long>(sizeof(float32))) throw dlib::serialization_error("Truncated code table in compressed model.");
+            table.quantization_precision.assign(leaf_value_num, load_value<float32>(p));
+            p += sizeof(float32);
+        }
+        table.tans = header.version >= MODEL_VERSION_TANS;
+        if (table.tans) {
+            if (end - p < static_cast<long>(sizeof(uint8) + sizeof(uint64))) throw dlib::serialization_error("Truncated code table in compressed model.");
+            const unsigned int table_log = load_value<uint8>(p);
+            const uint64 symbol_num = load_value<uint64>(p + sizeof(uint8));
+            p += sizeof(uint8) + sizeof(uint64);
+            if (table_log == 0 || table_log > TANS_MAX_TABLE_LOG || symbol_num == 0 || symbol_num > (1ull << table_log)) {
+                throw dlib::serialization_error("Invalid code table in compressed model.");
+            }
+            if (static_cast<uint64>(end - p) < symbol_num * (sizeof(int32) + sizeof(uint16))) throw dlib::serialization_error("Truncated code table in compressed model.");
+            std::vector< std::pair<int, unsigned int> > frequencies(symbol_num);
+            for (auto &it: frequencies) {
+                it.first = load_value<int32>(p);
+                it.second = load_value<uint16>(p + sizeof(int32));
+                p += sizeof(int32) + sizeof(uint16);
+            }
+            try {
+                table.tans_table = build_tans_table(frequencies, table_log);
+            } catch (std::invalid_argument &) {
+                throw dlib::serialization_error("Invalid code table in compressed model.");
+            }
+        }
+        
+        ctbl.clear();
+        table.canonical = (header.flags & MODEL_FLAG_CANONICAL_CODES) != 0;
+        if (!table.tans) p = parse_codes(p, end, ctbl, table.canonical);
+        
+        table.zero_run = (header.flags & MODEL_FLAG_ZERO_RUN) != 0;
+        table.zero_run_base = 0;
+        if (table.zero_run) {
+            if (end - p < static_cast<long>(sizeof(int32))) throw dlib::serialization_error("Truncated code table in compressed model.");
+            table.zero_run_base = load_value<int32>(p);
+            p += sizeof(int32);
+        }
+        if (!table.tans) table.decode_table = build_decode_table(ctbl);
+        return p;
+    }
+    
+    void parse_code_tables(const model_layout &layout, std::vector<leaf_code_table> &tables) {
+        const model_header &header = layout.header;
+        tables.resize((header.flags & MODEL_FLAG_LEVEL_CODE_TABLES) ? header.cascade_depth : 1);
+        const char *p = layout.code_table.data;
+        const char *end = layout.code_table.data + layout.code_table.size;
+        for (auto &table: tables) {
+            p = parse_code_table(p, end, header, table);
+        }
+    }
+    
+    /**
+     *  decodes a coded splits section, see write_coded_splits, into packed splits
+     */
+    void decode_coded_splits(const model_layout &layout, std::vector<uint32> &splits) {
+        const model_header &header = layout.header;
+        const char *p = layout.splits.data;
+        const char *end = p + layout.splits.size;
+        if (layout.splits.size < sizeof(uint8)) throw dlib::serialization_error("Truncated splits in compressed model.");
+        const unsigned int split_index_bits = load_value<uint8>(p);
+        if (split_index_bits != index_bits(header.feature_pool_size)) throw dlib::serialization_error("Invalid splits in compressed model.");
+        codetable ctbl;
+        p = parse_codes(p + sizeof(uint8), end, ctbl, (header.flags & MODEL_FLAG_CANONICAL_CODES) != 0);
+        for (auto &it: ctbl) {
+            if (it.first < -256 || it.first > 255 || it.second.empty()) throw dlib::serialization_error("Invalid splits in compressed model.");
+        }
+        const HuffmanDecodeTable decode_table = build_decode_table(ctbl);
+        
+        const uint64 split_num = header.cascade_depth * header.num_trees_per_cascade_level * header.num_splits();
+        splits.resize(split_num);
+        bit_reader reader(p, end - p);
+        for (uint64 idx = 0; idx < split_num; ++ idx) {
+            const uint32 idx1 = reader.read(split_index_bits);
+            const uint32 idx2 = reader.read(split_index_bits);
+            if (idx1 >= header.feature_pool_size || idx2 >= header.feature_pool_size) throw dlib::serialization_error("Invalid splits in compressed model.");
+            splits[idx] = pack_split(idx1, idx2, decode_symbol(decode_table, reader));
+        }
+        if (reader.tell() > static_cast<uint64>(end - p) * 8) throw dlib::serialization_error("Truncated splits in compressed model.");
+    }
+    
+    /**
+     *  the packed splits of a model with MODEL_FLAG_PACKED_SPLITS: the splits section
+     *  itself, or the splits of a coded splits section decoded into buffer
+     */
+    const char *packed_split_data(const model_layout &layout, std::vector<uint32> &buffer) {
+        if (!(layout.header.flags & MODEL_FLAG_CODED_SPLITS)) {
+            buffer.clear();
+            return layout.splits.data;
+        }
+        decode_coded_splits(layout, buffer);
+        return reinterpret_cast<const char *>(buffer.data());
+    }
+    
+    /**
+     *  start decoding a block of the leaf stream, returns the tANS state
+     */
+    inline uint32 start_leaf_block(const leaf_code_table &table, bit_reader &reader) {
+        return table.tans ? start_tans_block(table.tans_table, reader) : 0;
+    }
+    
+    /**
+     *  decode the n quantization values of one leaf vector
+     */
+    inline void decode_leaf_codes(const leaf_code_table &table, bit_reader &reader, uint32 &state, int32 *codes, uint64 n) {
+        uint64 idx = 0;
+        while (idx < n) {
+            int32 symbol = table.tans ? decode_tans_symbol(table.tans_table, state, reader) : decode_symbol(table.decode_table, reader);
+            if (table.zero_run && symbol > table.zero_run_base) {
+                uint64 run = std::min<uint64>(symbol - table.zero_run_base, n - idx);
+                std::fill(codes + idx, codes + idx + run, 0);
+                idx += run;
+            } else {
+                codes[idx ++] = symbol;
+            }
+        }
+    }
+    
+    /**
+     *  decode the leaf values of trees [tree_begin, tree_end) of one cascade level,
+     *  starting at bit_offset of the leaf stream. Returns the bit offset after them.
+     */
+    uint64 decode_leaf_values(dlib::shape_predictor &sp, const model_layout &layout, const leaf_code_table &table,
+                              uint64 level, uint64 tree_begin, uint64 tree_end, uint64 bit_offset) {
+        const uint64 num_leaves = layout.header.num_leaves();
+        const uint64 leaf_value_num = layout.header.leaf_value_num();
+        bit_reader reader(layout.leaf_values.data, layout.leaf_values.size, bit_offset);
+        uint32 state = start_leaf_block(table, reader);
+        std::vector<int32> codes(leaf_value_num);
+        
+        for (uint64 r = tree_begin; r < tree_end; ++ r) {
+            auto &leaf_values = sp.forests[level][r].leaf_values;
+            leaf_values.resize(num_leaves);
+            for (int leaf_value_idx = 0; leaf_value_idx < num_leaves; ++ leaf_value_idx) {
+                dlib::matrix<float,0,1> &_leaf = leaf_values[leaf_value_idx];
+                _leaf.set_size(leaf_value_num, 1);
+                
+                decode_leaf_codes(table, reader, state, &codes[0], leaf_value_num);
+                for (int _idx = 0; _idx < leaf_value_num; ++ _idx) {
+                    _leaf(_idx) = codes[_idx] * table.quantization_precision[_idx];
+                }
+            }
+        }
+        return reader.tell();
+    }
+    
+    /**
+     *  decodes the leaf rows section, see write_leaf_rows
+     */
+    void decode_leaf_rows(const model_layout &layout, std::vector<uint32> &rows) {
+        const model_header &header = layout.header;
+        const unsigned int row_bits = index_bits(layout.codebook_size);
+        rows.resize(header.cascade_depth * header.num_trees_per_cascade_level * header.num_leaves());
+        bit_reader reader(layout.leaf_rows.data + sizeof(uint64), layout.leaf_rows.size - sizeof(uint64));
+        for (auto &row: rows) {
+            row = reader.read(row_bits);
+            if (row >= layout.codebook_size) throw dlib::serialization_error("Invalid leaf rows in compressed model.");
+        }
+    }
+    
+    /**
+     *  decode the leaf values of one cascade level of a model with a leaf codebook: the
+     *  codebook of the level, with every tree leaf set to its row
+     */
+    void decode_leaf_codebook(dlib::shape_predictor &sp, const model_layout &layout, const leaf_code_table &table,
+                              uint64 level, const std::vector<uint32> &rows) {
+        const uint64 num_leaves = layout.header.num_leaves();
+        const uint64 leaf_value_num = layout.header.leaf_value_num();
+        bit_reader reader(layout.leaf_values.data, layout.leaf_values.size, layout.block_bit_offset(level));
+        uint32 state = start_leaf_block(table, reader);
+        std::vector<int32> codes(leaf_value_num);
+        
+        std::vector<dlib::matrix<float,0,1> > codebook(layout.codebook_size);
+        for (auto &row: codebook) {
+            row.set_size(leaf_value_num, 1);
+            decode_leaf_codes(table, reader, state, &codes[0], leaf_value_num);
+            for (int _idx = 0; _idx < leaf_value_num; ++ _idx) {
+                row(_idx) = codes[_idx] * table.quantization_precision[_idx];
+            }
+        }
+        
+        const uint32 *level_rows = &rows[level * layout.header.num_trees_per_cascade_level * num_leaves];
+        for (uint64 r = 0; r < layout.header.num_trees_per_cascade_level; ++ r) {
+            auto &leaf_values = sp.forests[level][r].leaf_values;
+            leaf_values.resize(num_leaves);
+            for (uint64 leaf_value_idx = 0; leaf_value_idx < num_leaves; ++ leaf_value_idx) {
+                leaf_values[leaf_value_idx] = codebook[level_rows[r * num_leaves + leaf_value_idx]];
+            }
+        }
+    }
+    
+    /**
+     *  build a shape predictor from a parsed compressed model
+     *
+     *  If the leaf stream is indexed its blocks are decoded on num_threads threads
+     *  (0 for one per core).
+     */
+    void load_shape_predictor_model(dlib::shape_predictor &sp, const model_layout &layout, unsigned long num_threads=0,
+                                    model_stats *stats=NULL) {
         
-        read_single_value(is, data_length);
-        read_single_value(is, version);
-        read_single_value(is, cascade_depth);
-        read_single_value(is, num_trees_per_cascade_level);
-        read_single_value(is, tree_depth);
-        read_single_value(is, feature_pool_size);
-        read_single_value(is, landmark_num);
-        read_single_value(is, quantization_num);
-        read_single_value(is, prune_thresh);
+        using namespace std;
+        stage_recorder recorder(stats);
+        const model_header &header = layout.header;
+        const uint64 cascade_depth = header.cascade_depth;
+        const uint64 num_trees_per_cascade_level = header.num_trees_per_cascade_level;
+        const uint64 feature_pool_size = header.feature_pool_size;
+        const uint64 landmark_num = header.landmark_num;
         
         /**
          *  initial shape
          */
-        read_single_value(is, data_length);
-        
         sp.initial_shape.set_size(landmark_num * 2, 1);
-        
-        {
-            std::vector<float> data;
-            read_float_vec(is, data, landmark_num * 2);
-            for (int idx = 0; idx < landmark_num * 2; ++ idx) {
-                sp.initial_shape(idx) = data[idx];
-            }
+        for (int idx = 0; idx < landmark_num * 2; ++ idx) {
+            sp.initial_shape(idx) = load_value<float32>(layout.initial_shape.data + idx * sizeof(float32));
         }
+        recorder.record("initial_shape", layout.initial_shape.size);
         
         /**
          *  anchor_idx
          */
-        read_single_value(is, data_length);
         sp.anchor_idx = vector<vector<unsigned long> >(
             cascade_depth, vector<unsigned long>(feature_pool_size, 0));
-        
-        {
-            vector<char> data;
-            for (int r = 0; r < cascade_depth; ++ r) {
-                read_char_vec(is, data, feature_pool_size);
-                for (int c = 0; c < feature_pool_size; ++ c) {
-                    sp.anchor_idx[r][c] = static_cast<unsigned long>(data[c]);
-                }
+        for (int r = 0; r < cascade_depth; ++ r) {
+            for (int c = 0; c < feature_pool_size; ++ c) {
+                sp.anchor_idx[r][c] = static_cast<unsigned long>(load_value<uint8>(layout.anchor_idx.data + r * feature_pool_size + c));
             }
         }
+        recorder.record("anchor_idx", layout.anchor_idx.size);
         
         /**
          *  deltas
          */
-        read_single_value(is, data_length);
         sp.deltas = std::vector<std::vector<dlib::vector<float,2> > >(
             cascade_depth, std::vector<dlib::vector<float,2> >(
                 feature_pool_size, dlib::vector<float,2>()));
-
-        {
-            std::vector<float> data;
-            read_float_vec(is, data, cascade_depth * feature_pool_size * 2);
-            for (int r = 0; r < cascade_depth; ++ r) {
-                for (int c = 0; c < feature_pool_size; ++ c) {
-                    int idx = r * feature_pool_size + c;
-                    sp.deltas[r][c](0) = data[idx * 2];
-                    sp.deltas[r][c](1) = data[idx * 2 + 1];
-                }
+        for (int r = 0; r < cascade_depth; ++ r) {
+            for (int c = 0; c < feature_pool_size; ++ c) {
+                const char *p = layout.deltas.data + (r * feature_pool_size + c) * 2 * sizeof(float32);
+                sp.deltas[r][c](0) = load_value<float32>(p);
+                sp.deltas[r][c](1) = load_value<float32>(p + sizeof(float32));
             }
         }
+        recorder.record("deltas", layout.deltas.size);
         
         /**
          *  forests
@@ -375,104 +1879,120 @@ namespace med {
         /**
          *  splits
          */
-        
-        read_single_value(is, data_length);
-        
         sp.forests = std::vector<std::vector<dlib::impl::regression_tree> >(
             cascade_depth, std::vector<dlib::impl::regression_tree>(
                 num_trees_per_cascade_level, dlib::impl::regression_tree()));
         
-        unsigned long split_num = static_cast<unsigned long>(std::round(pow(2, tree_depth) - 1));
-        uint16 idx1, idx2;
-        float32 thresh;
+        const uint64 split_num = header.num_splits();
+        std::vector<uint32> split_buffer;
+        const char *split_data = (header.flags & MODEL_FLAG_PACKED_SPLITS) ? packed_split_data(layout, split_buffer) : layout.splits.data;
         for (int r = 0; r < cascade_depth; ++ r) {
             for (int c = 0; c < num_trees_per_cascade_level; ++ c) {
-                auto &tree = sp.forests[r][c];
-                auto &splits = tree.splits;
-                dlib::impl::split_feature fea;
+                auto &splits = sp.forests[r][c].splits;
+                splits.resize(split_num);
                 for (int idx = 0; idx < split_num; ++ idx) {
-                    read_single_value(is, idx1);
-                    read_single_value(is, idx2);
-                    read_single_value(is, thresh);
-                    fea.idx1 = static_cast<unsigned long>(idx1);
-                    fea.idx2 = static_cast<unsigned long>(idx2);
-                    fea.thresh = static_cast<float>(thresh);
-                    splits.push_back(fea);
+                    if (header.flags & MODEL_FLAG_PACKED_SPLITS) {
+                        // halfway between integer differences, so that non-integer pixel
+                        // values are split evenly
+                        uint32 split = load_value<uint32>(split_data);
+                        splits[idx].idx1 = packed_split_idx1(split);
+                        splits[idx].idx2 = packed_split_idx2(split);
+                        splits[idx].thresh = packed_split_thresh(split) + 0.5f;
+                        split_data += sizeof(uint32);
+                        continue;
+                    }
+                    splits[idx].idx1 = static_cast<unsigned long>(load_value<uint16>(split_data));
+                    splits[idx].idx2 = static_cast<unsigned long>(load_value<uint16>(split_data + 2));
+                    splits[idx].thresh = static_cast<float>(load_value<float32>(split_data + 4));
+                    split_data += 8;
                 }
-                splits.reserve(splits.size());
             }
         }
-        
+        recorder.record("splits", layout.splits.size);
         
         /**
          *  leaf values
          */
         
-        /*** code table ***/
-        read_single_value(is, data_length);
-        float32 quantization_precision = 0.;
-        read_single_value(is, quantization_precision);
-        uint64 ctbl_size;
-        read_single_value(is, ctbl_size);
-        
-        unordered_map<int, std::vector<bool> > ctbl;
-        
-        while (ctbl_size > 0) {
-            int k;
-            uint8 bit_num;
-            std::vector<char> data;
-            read_single_value(is, k);
-            read_single_value(is, bit_num);
-            read_char_vec(is, data, (bit_num + 7) / 8);
-            std::vector<bool> bits;
-            chars_to_bits(data, bits, bit_num);
-            ctbl[k] = bits;
-            -- ctbl_size;
-        }
-        
-        auto *huffman_tree = build_tree_from_lookup_table(ctbl);
+        /*** code tables ***/
+        vector<leaf_code_table> tables;
+        parse_code_tables(layout, tables);
+        recorder.record("code_table", layout.code_table.size);
         
-        /*** read and decode leaf values ***/
-        read_single_value(is, data_length);
-        
-        {
-            std::vector<char> leaf_value_chars;
-            read_char_vec(is, leaf_value_chars, data_length);
-            
-            uint64 num_leaves = static_cast<unsigned long>(std::round(pow(2, tree_depth)));
-            uint64 offset = 0;
-            
-            for (int c = 0; c < cascade_depth; ++ c) {
-                for (int r = 0; r < num_trees_per_cascade_level; ++ r) {
-                    auto &tree = sp.forests[c][r];
-                    auto &leaf_values = tree.leaf_values;
-                    for (int leaf_value_idx = 0; leaf_value_idx < num_leaves; ++ leaf_value_idx) {
-                        dlib::matrix<float,0,1> _leaf;
-                        _leaf.set_size(landmark_num * 2, 1);
-                        
-                        for (int _idx = 0; _idx < landmark_num * 2; ++ _idx) {
-                            auto *t = huffman_tree;
-                            while (t->left || t->right) {
-                                int c = offset / 8;
-                                int p = offset % 8;
-                                bool v = leaf_value_chars[c] & (1 << (7 - p));
-                                if (!v) t = t->left;
-                                else t = t->right;
-                                ++ offset;
-                            }
-                            _leaf(_idx) = t->c * quantization_precision;
-                        }
-                        
-                        leaf_values.push_back(_leaf);
-                    }
-                    leaf_values.reserve(leaf_values.size());
-                }
+        /*** decode leaf values ***/
+        if (layout.index_block_trees == 0) {
+            uint64 bit_offset = 0;
+            for (uint64 c = 0; c < cascade_depth; ++ c) {
+                bit_offset = decode_leaf_values(sp, layout, level_code_table(tables, c),
+                                                c, 0, num_trees_per_cascade_level, bit_offset);
             }
+        } else if (layout.codebook_size) {
+            if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+            vector<uint32> rows;
+            decode_leaf_rows(layout, rows);
+            dlib::parallel_for(num_threads, 0, cascade_depth, [&](long level) {
+                decode_leaf_codebook(sp, layout, level_code_table(tables, level), level, rows);
+            });
+        } else {
+            if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+            const uint64 blocks_per_level = layout.blocks_per_level();
+            dlib::parallel_for(num_threads, 0, layout.num_index_blocks, [&](long block) {
+                const uint64 level = block / blocks_per_level;
+                const uint64 tree_begin = (block % blocks_per_level) * layout.index_block_trees;
+                const uint64 tree_end = std::min(tree_begin + layout.index_block_trees, num_trees_per_cascade_level);
+                decode_leaf_values(sp, layout, level_code_table(tables, level),
+                                   level, tree_begin, tree_end, layout.block_bit_offset(block));
+            });
         }
-        
-        destroy_tree(huffman_tree);
+        recorder.record("leaf_values", layout.leaf_index.size + layout.leaf_values.size + layout.leaf_rows.size);
+    }
+    
+    /**
+     *  load a compressed shape predictor model
+     */
+    void load_shape_predictor_model(dlib::shape_predictor &sp, const std::string&filename, unsigned long num_threads=0,
+                                    model_stats *stats=NULL) {
+        stage_recorder recorder(stats);
+        mapped_file file(filename);
+        recorder.record("map", file.size());
+        model_layout layout;
+        parse_model_layout(file.data(), file.size(), layout);
+        recorder.record("header", layout.initial_shape.data - file.data() - sizeof(uint64));
+        load_shape_predictor_model(sp, layout, num_threads, stats);
+    }
+    
+    /**
+     *  load a compressed shape predictor model from its image in memory, such as the
+     *  array of a header written by embed_model.cpp
+     */
+    void load_shape_predictor_model(dlib::shape_predictor &sp, const uint8 *data, uint64 size, unsigned long num_threads=0,
+                                    model_stats *stats=NULL) {
+        stage_recorder recorder(stats);
+        model_layout layout;
+        parse_model_layout(reinterpret_cast<const char *>(data), size, layout);
+        recorder.record("header", layout.initial_shape.data - reinterpret_cast<const char *>(data) - sizeof(uint64));
+        load_shape_predictor_model(sp, layout, num_threads, stats);
     }
     
 }
 
+#if defined(MED_COUNT_ALLOCATIONS)
+/**
+ *  counting replacement of the global operator new, see med::allocation_counter
+ */
+void *operator new(std::size_t size) {
+    ++ med::allocation_counter();
+    if (void *p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    std::free(p);
+}
+#endif
+
 #endif /* model_utils_h */
@@ -0,0 +1,57 @@
+//
+//  pack_models.cpp
+//  dlib_utils
+//
+//  Created by zhaoyu on 2018/1/8.
+//  Copyright © 2018 zhaoyu. All rights reserved.
+//
+
+#include <iostream>
+#include <iomanip>
+
+#include <model_container.hpp>
+
+/**
+ *  pack several compressed models into one container file, or list the models of a
+ *  container. Load one of them by name:
+ *
+ *      med::model_container container("models.medc");
+ *      med::load_shape_predictor_model(sp, container, "face68");
+ *      med::compressed_shape_predictor csp("models.medc", "face68");
+ */
+int main(int argc, const char * argv[]) {
+    
+    if (argc < 2) {
+        std::cout << "Usage: ./pack_models.bin container_path [name=compressed_model_path ...]" << std::endl;
+        return 0;
+    }
+    
+    if (argc == 2) {
+        med::model_container container(argv[1]);
+        for (auto &name: container.names()) {
+            med::uint64 size = 0;
+            for (auto &section: container.sections(name)) size += sizeof(med::uint64) + section.size;
+            std::cout << name << ": " << size / 1024 << " KB" << std::endl;
+        }
+        return 0;
+    }
+    
+    med::model_container_writer writer;
+    med::uint64 models_size = 0;
+    for (int idx = 2; idx < argc; ++ idx) {
+        const std::string arg = argv[idx];
+        const std::string::size_type eq = arg.find('=');
+        if (eq == std::string::npos || eq == 0) {
+            std::cout << "Expected name=compressed_model_path, got " << arg << std::endl;
+            return 1;
+        }
+        med::mapped_file file(arg.substr(eq + 1));
+        writer.add(arg.substr(0, eq), file.data(), file.size());
+        models_size += file.size();
+    }
+    const med::uint64 container_size = writer.save(argv[1]);
+    std::cout << writer.size() << " models, " << models_size / 1024 << " KB -> " << container_size / 1024
+              << " KB, " << writer.shared_bytes() / 1024 << " KB of shared sections" << std::endl;
+    
+    return 0;
+}
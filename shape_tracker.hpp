@@ -0,0 +1,136 @@
+//
+//  shape_tracker.hpp
+//  dlib_utils
+//
+//  Created by zhaoyu on 2018/1/8.
+//  Copyright © 2018 zhaoyu. All rights reserved.
+//
+
+#ifndef shape_tracker_h
+#define shape_tracker_h
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <compressed_shape_predictor.hpp>
+
+
+namespace med {
+    
+    struct tracking_options {
+        tracking_options() :
+        skip_levels(4), max_motion(0.2), max_scale_change(0.2), max_shape_residual(0.1), refresh_interval(30) {}
+        
+        // cascade levels skipped when a frame starts from the previous shape
+        unsigned long skip_levels;
+        // largest move of the rectangle center between two frames, relative to the
+        // rectangle size, that starts from the previous shape
+        double max_motion;
+        // largest relative change of the rectangle size that starts from the previous shape
+        double max_scale_change;
+        // a tracked shape is redone from the mean shape when it differs from the mean
+        // shape by more than this, see shape_residual
+        double max_shape_residual;
+        // every refresh_interval-th frame runs the whole cascade, 0 for never
+        unsigned long refresh_interval;
+    };
+    
+    /**
+     *  mean distance between the landmarks of shape, aligned to mean_shape with a
+     *  similarity transform, and those of mean_shape, in the normalized coordinates
+     *  of rect (the rectangle is the unit square). Large values mean the shape does
+     *  not look like a face anymore.
+     */
+    inline double shape_residual(const dlib::full_object_detection &shape, const dlib::rectangle &rect,
+                                 const dlib::matrix<float,0,1> &mean_shape) {
+        const dlib::point_transform_affine tform_from_img = dlib::impl::normalizing_tform(rect);
+        std::vector<dlib::vector<float,2> > from, to;
+        for (unsigned long idx = 0; idx < shape.num_parts(); ++ idx) {
+            from.push_back(tform_from_img(shape.part(idx)));
+            to.push_back(dlib::impl::location(mean_shape, idx));
+        }
+        if (from.empty()) return 0;
+        const dlib::point_transform_affine tform = dlib::find_similarity_transform(from, to);
+        double residual = 0;
+        for (unsigned long idx = 0; idx < from.size(); ++ idx) {
+            residual += (tform(from[idx]) - to[idx]).length();
+        }
+        return residual / from.size();
+    }
+    
+    /**
+     *  landmarks of one face across the frames of a video
+     *
+     *  A frame starts from the landmarks of the previous frame mapped into the new
+     *  rectangle and skips the first options.skip_levels cascade levels, which do the
+     *  coarse alignment the previous shape already has. The whole cascade runs from
+     *  the mean shape instead on the first frame, every refresh_interval-th frame,
+     *  when the rectangle moved or changed its size too much, and when the tracked
+     *  shape fails the shape_residual check.
+     *
+     *  Use one tracker per face. A tracker is not thread safe, but several trackers
+     *  can share one predictor.
+     */
+    class shape_tracker {
+    public:
+        explicit shape_tracker(const compressed_shape_predictor &sp, const tracking_options &options=tracking_options()) :
+        sp_(sp), options_(options), frames_(0), warm_frames_(0), since_full_(0), has_previous_(false), warm_started_(false) {}
+        
+        template <typename image_type>
+        dlib::full_object_detection operator()(const image_type &img, const dlib::rectangle &rect) {
+            ++ frames_;
+            warm_started_ = false;
+            dlib::full_object_detection shape;
+            if (can_warm_start(rect)) {
+                const unsigned long first_level = std::min<unsigned long>(options_.skip_levels, sp_.num_cascade_levels() - 1);
+                shape = sp_(img, rect, previous_, first_level);
+                warm_started_ = shape_residual(shape, rect, sp_.initial_shape()) <= options_.max_shape_residual;
+            }
+            if (warm_started_) {
+                ++ warm_frames_;
+                ++ since_full_;
+            } else {
+                shape = sp_(img, rect);
+                since_full_ = 0;
+            }
+            previous_ = shape;
+            has_previous_ = true;
+            return shape;
+        }
+        
+        // the next frame runs the whole cascade, e.g. after the face was lost
+        void reset() {
+            has_previous_ = false;
+        }
+        
+        bool last_warm_started() const { return warm_started_; }
+        unsigned long frames() const { return frames_; }
+        unsigned long warm_frames() const { return warm_frames_; }
+        const tracking_options &options() const { return options_; }
+    
+    private:
+        bool can_warm_start(const dlib::rectangle &rect) const {
+            if (!has_previous_ || sp_.num_cascade_levels() == 0) return false;
+            if (options_.refresh_interval && since_full_ + 1 >= options_.refresh_interval) return false;
+            
+            const dlib::rectangle &last = previous_.get_rect();
+            const double size = std::max(1.0, std::sqrt(static_cast<double>(last.width()) * last.height()));
+            const dlib::dpoint motion = dlib::center(rect) - dlib::center(last);
+            if (motion.length() > options_.max_motion * size) return false;
+            const double scale = std::sqrt(static_cast<double>(rect.width()) * rect.height()) / size;
+            return std::abs(scale - 1) <= options_.max_scale_change;
+        }
+        
+        const compressed_shape_predictor &sp_;
+        tracking_options options_;
+        unsigned long frames_;
+        unsigned long warm_frames_;
+        unsigned long since_full_;      // warm started frames since the last full run
+        bool has_previous_;
+        bool warm_started_;
+        dlib::full_object_detection previous_;
+    };
+    
+}
+
+#endif /* shape_tracker_h */
@@ -0,0 +1,128 @@
+//
+//  stream.cpp
+//  dlib_utils
+//
+//  Created by zhaoyu on 2018/1/8.
+//  Copyright © 2018 zhaoyu. All rights reserved.
+//
+
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <limits>
+
+#include <stream_pipeline.hpp>
+#include <eval_utils.hpp>
+
+/**
+ *  whether pattern has exactly one conversion, an int one such as %d or %06d, besides %%
+ */
+bool is_frame_pattern(const std::string &pattern) {
+    int conversions = 0;
+    for (std::string::size_type idx = 0; idx < pattern.size(); ++ idx) {
+        if (pattern[idx] != '%') continue;
+        if (++ idx < pattern.size() && pattern[idx] == '%') continue;
+        while (idx < pattern.size() && std::strchr("-+ #0", pattern[idx])) ++ idx;
+        while (idx < pattern.size() && std::isdigit(static_cast<unsigned char>(pattern[idx]))) ++ idx;
+        if (idx == pattern.size() || !std::strchr("diuxX", pattern[idx])) return false;
+        ++ conversions;
+    }
+    return conversions == 1;
+}
+
+/**
+ *  images of input: the files of a directory in name order, or the sequence of a
+ *  printf pattern with one int conversion, such as frames/%06d.png, from index start
+ *  up to the first missing one
+ */
+std::vector<std::string> list_frames(const std::string &input, unsigned long start) {
+    std::vector<std::string> paths;
+    if (input.find('%') == std::string::npos) {
+        std::vector<dlib::file> files = dlib::directory(input).get_files();
+        std::sort(files.begin(), files.end());
+        for (auto &file: files) paths.push_back(file.full_name());
+        return paths;
+    }
+    if (!is_frame_pattern(input)) throw dlib::error("Expected one %d conversion in the frame pattern " + input);
+    std::vector<char> path(input.size() + 32);
+    for (unsigned long index = start; index <= static_cast<unsigned long>(std::numeric_limits<int>::max()); ++ index) {
+        int length = std::snprintf(&path[0], path.size(), input.c_str(), static_cast<int>(index));
+        if (length < 0) throw dlib::error("Invalid frame pattern " + input);
+        if (static_cast<std::size_t>(length) >= path.size()) {
+            path.resize(length + 1);
+            std::snprintf(&path[0], path.size(), input.c_str(), static_cast<int>(index));
+        }
+        if (!std::ifstream(&path[0])) break;
+        paths.push_back(&path[0]);
+    }
+    return paths;
+}
+
+/**
+ *  run a compressed model over a stream of images: decode -> face detection ->
+ *  landmarks -> output, every stage on its own worker threads. Writes one line per
+ *  frame with the frame index, its path, the number of faces and every face as its
+ *  rectangle followed by its landmarks, and reports the throughput and the latency of
+ *  every stage.
+ */
+int main(int argc, const char * argv[]) {
+    
+    if (argc < 3) {
+        std::cout << "Usage: ./stream.bin compressed_model_path image_dir_or_pattern [--name model_in_container] "
+                     "[--decode 2] [--detect 4] [--landmark 1] [--queue 16] [--start 0] [--loops 1] "
+                     "[--out landmarks.txt] [--report report.json]" << std::endl;
+        return 0;
+    }
+    
+    med::stream_options options;
+    std::string model_name, out_path, report_path;
+    unsigned long start = 0, loops = 1;
+    for (int idx = 3; idx + 1 < argc; idx += 2) {
+        std::string key = argv[idx];
+        if (key == "--name") model_name = argv[idx + 1];
+        else if (key == "--decode") options.workers[med::STREAM_DECODE] = med::parse_list<unsigned long>(argv[idx + 1]).at(0);
+        else if (key == "--detect") options.workers[med::STREAM_DETECT] = med::parse_list<unsigned long>(argv[idx + 1]).at(0);
+        else if (key == "--landmark") options.workers[med::STREAM_LANDMARK] = med::parse_list<unsigned long>(argv[idx + 1]).at(0);
+        else if (key == "--queue") options.queue_capacity = med::parse_list<unsigned long>(argv[idx + 1]).at(0);
+        else if (key == "--start") start = med::parse_list<unsigned long>(argv[idx + 1]).at(0);
+        else if (key == "--loops") loops = std::max(1ul, med::parse_list<unsigned long>(argv[idx + 1]).at(0));
+        else if (key == "--out") out_path = argv[idx + 1];
+        else if (key == "--report") report_path = argv[idx + 1];
+    }
+    
+    med::compressed_shape_predictor sp;
+    if (model_name.empty()) sp.open(argv[1]);
+    else sp.open(argv[1], model_name);
+    // decode every level up front, so that the first frames do not pay for it
+    sp.load_progressively(sp.num_cascade_levels());
+    
+    const std::vector<std::string> frames = list_frames(argv[2], start);
+    std::vector<std::string> paths;
+    for (unsigned long loop = 0; loop < loops; ++ loop) paths.insert(paths.end(), frames.begin(), frames.end());
+    if (paths.empty()) {
+        std::cout << "No images in " << argv[2] << std::endl;
+        return 1;
+    }
+    
+    std::ofstream out;
+    if (!out_path.empty()) out.open(out_path);
+    const med::stream_report report = med::run_landmark_stream(paths, sp, options, [&](const med::stream_frame &frame) {
+        if (!out.is_open()) return;
+        out << frame.index << " " << frame.path << " " << frame.shapes.size();
+        for (auto &shape: frame.shapes) {
+            const dlib::rectangle &rect = shape.get_rect();
+            out << " " << rect.left() << " " << rect.top() << " " << rect.right() << " " << rect.bottom();
+            for (unsigned long idx = 0; idx < shape.num_parts(); ++ idx) {
+                out << " " << shape.part(idx).x() << " " << shape.part(idx).y();
+            }
+        }
+        out << "\n";
+    });
+    
+    std::cout << report.to_string();
+    if (!report_path.empty()) std::ofstream(report_path) << report.to_json() << std::endl;
+    
+    return 0;
+}
@@ -0,0 +1,361 @@
+//
+//  stream_pipeline.hpp
+//  dlib_utils
+//
+//  Created by zhaoyu on 2018/1/8.
+//  Copyright © 2018 zhaoyu. All rights reserved.
+//
+
+#ifndef stream_pipeline_h
+#define stream_pipeline_h
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <dlib/image_processing.h>
+#include <dlib/image_processing/frontal_face_detector.h>
+#include <dlib/image_io.h>
+#include <compressed_shape_predictor.hpp>
+
+
+namespace med {
+    
+    /**
+     *  bounded lock-free multi-producer multi-consumer queue: a ring of cells, each with
+     *  a sequence number that tells whether it is free for the producer of a position
+     *  or full for its consumer. push and pop yield the thread for a few tries while
+     *  the queue is full or empty, and then sleep between tries, so that an idle stage
+     *  does not keep a core busy. After close(), pop returns false once the queue is
+     *  drained.
+     */
+    template <typename T>
+    class bounded_queue {
+    public:
+        explicit bounded_queue(unsigned long capacity) : head_(0), tail_(0), closed_(false) {
+            unsigned long size = 2;
+            while (size < capacity) size <<= 1;
+            cells_.reset(new cell[size]);
+            mask_ = size - 1;
+            for (unsigned long idx = 0; idx < size; ++ idx) cells_[idx].sequence.store(idx, std::memory_order_relaxed);
+        }
+        
+        bool try_push(T &item) {
+            uint64 pos = tail_.load(std::memory_order_relaxed);
+            cell *c;
+            for (;;) {
+                c = &cells_[pos & mask_];
+                const int64 diff = static_cast<int64>(c->sequence.load(std::memory_order_acquire)) - static_cast<int64>(pos);
+                if (diff == 0) {
+                    if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = tail_.load(std::memory_order_relaxed);
+                }
+            }
+            c->value = std::move(item);
+            c->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+        
+        bool try_pop(T &item) {
+            uint64 pos = head_.load(std::memory_order_relaxed);
+            cell *c;
+            for (;;) {
+                c = &cells_[pos & mask_];
+                const int64 diff = static_cast<int64>(c->sequence.load(std::memory_order_acquire)) - static_cast<int64>(pos + 1);
+                if (diff == 0) {
+                    if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = head_.load(std::memory_order_relaxed);
+                }
+            }
+            item = std::move(c->value);
+            c->sequence.store(pos + mask_ + 1, std::memory_order_release);
+            return true;
+        }
+        
+        void push(T &item) {
+            for (unsigned long tries = 0; !try_push(item); ++ tries) wait(tries);
+        }
+        
+        bool pop(T &item) {
+            for (unsigned long tries = 0; ; ++ tries) {
+                if (try_pop(item)) return true;
+                // every push completed before the close, so a last look finds them all
+                if (closed_.load(std::memory_order_acquire)) return try_pop(item);
+                wait(tries);
+            }
+        }
+        
+        void close() { closed_.store(true, std::memory_order_release); }
+    
+    private:
+        bounded_queue(const bounded_queue &);
+        bounded_queue &operator=(const bounded_queue &);
+        
+        static void wait(unsigned long tries) {
+            if (tries < 64) std::this_thread::yield();
+            else std::this_thread::sleep_for(std::chrono::microseconds(tries < 256 ? 50 : 500));
+        }
+        
+        struct cell {
+            std::atomic<uint64> sequence;
+            T value;
+        };
+        
+        std::unique_ptr<cell[]> cells_;
+        uint64 mask_;
+        // producers and consumers work on different cache lines
+        char pad0_[64];
+        std::atomic<uint64> head_;
+        char pad1_[64];
+        std::atomic<uint64> tail_;
+        char pad2_[64];
+        std::atomic<bool> closed_;
+    };
+    
+    /**
+     *  stages of the landmark stream, in order
+     */
+    enum stream_stage {
+        STREAM_DECODE = 0,
+        STREAM_DETECT = 1,
+        STREAM_LANDMARK = 2,
+        STREAM_EMIT = 3,
+        STREAM_STAGE_NUM = 4
+    };
+    
+    inline const char *stream_stage_name(unsigned long stage) {
+        static const char *names[STREAM_STAGE_NUM] = {"decode", "detect", "landmark", "emit"};
+        return names[stage];
+    }
+    
+    /**
+     *  a frame on its way through the stream. decoded is false if the image could not
+     *  be loaded, in which case the frame skips detection and landmarks.
+     */
+    struct stream_frame {
+        stream_frame() : index(0), decoded(false) {
+            std::fill(stage_ms, stage_ms + STREAM_STAGE_NUM, 0.);
+        }
+        
+        uint64 index;
+        std::string path;
+        bool decoded;
+        dlib::matrix<unsigned char> img;
+        std::vector<dlib::rectangle> faces;
+        std::vector<dlib::full_object_detection> shapes;
+        std::chrono::steady_clock::time_point start;       // when decoding started
+        double stage_ms[STREAM_STAGE_NUM];                 // time spent in every stage
+    };
+    
+    struct stream_options {
+        stream_options() : queue_capacity(16) {
+            const unsigned long cores = std::max(1u, std::thread::hardware_concurrency());
+            workers[STREAM_DECODE] = std::max(1ul, cores / 4);
+            workers[STREAM_DETECT] = std::max(1ul, cores / 2);
+            workers[STREAM_LANDMARK] = 1;
+            workers[STREAM_EMIT] = 1;
+        }
+        
+        // threads of every stage. The emit stage always runs on one thread, so that
+        // the callback needs no locking.
+        unsigned long workers[STREAM_STAGE_NUM];
+        // frames every queue between two stages holds
+        unsigned long queue_capacity;
+    };
+    
+    /**
+     *  latency distribution of one stage, or of whole frames, in milliseconds
+     */
+    struct latency_stats {
+        latency_stats() : mean(0), p50(0), p99(0), max(0), total(0) {}
+        
+        double mean, p50, p99, max;
+        double total;
+        
+        static latency_stats from(std::vector<double> ms) {
+            latency_stats stats;
+            if (ms.empty()) return stats;
+            std::sort(ms.begin(), ms.end());
+            for (double v: ms) stats.total += v;
+            stats.mean = stats.total / ms.size();
+            stats.p50 = ms[(ms.size() - 1) / 2];
+            stats.p99 = ms[(ms.size() - 1) * 99 / 100];
+            stats.max = ms.back();
+            return stats;
+        }
+    };
+    
+    /**
+     *  throughput and per-stage latency of a stream. busy is the share of the wall time
+     *  the workers of a stage spent working: the stage close to 1 is the bottleneck.
+     */
+    struct stream_report {
+        stream_report() : frames(0), failed(0), faces(0), seconds(0) {
+            std::fill(workers, workers + STREAM_STAGE_NUM, 0);
+            std::fill(busy, busy + STREAM_STAGE_NUM, 0.);
+        }
+        
+        uint64 frames;
+        uint64 failed;
+        uint64 faces;
+        double seconds;
+        unsigned long workers[STREAM_STAGE_NUM];
+        latency_stats stages[STREAM_STAGE_NUM];
+        double busy[STREAM_STAGE_NUM];
+        latency_stats frame;           // from the start of decoding to the end of emit
+        
+        double frames_per_second() const { return seconds > 0 ? frames / seconds : 0; }
+        
+        std::string to_string() const {
+            std::ostringstream os;
+            os << std::fixed << std::setprecision(2);
+            os << frames << " frames (" << failed << " failed), " << faces << " faces in " << seconds << " s, "
+               << frames_per_second() << " frames/s" << std::endl;
+            os << std::setw(10) << "stage" << std::setw(9) << "workers" << std::setw(10) << "mean_ms"
+               << std::setw(10) << "p50_ms" << std::setw(10) << "p99_ms" << std::setw(10) << "max_ms"
+               << std::setw(8) << "busy" << std::endl;
+            for (unsigned long stage = 0; stage < STREAM_STAGE_NUM; ++ stage) {
+                const latency_stats &s = stages[stage];
+                os << std::setw(10) << stream_stage_name(stage) << std::setw(9) << workers[stage]
+                   << std::setw(10) << s.mean << std::setw(10) << s.p50 << std::setw(10) << s.p99
+                   << std::setw(10) << s.max << std::setw(8) << busy[stage] << std::endl;
+            }
+            os << std::setw(10) << "frame" << std::setw(9) << "" << std::setw(10) << frame.mean
+               << std::setw(10) << frame.p50 << std::setw(10) << frame.p99 << std::setw(10) << frame.max << std::endl;
+            return os.str();
+        }
+        
+        std::string to_json() const {
+            std::ostringstream os;
+            os << "{\"frames\": " << frames << ", \"failed\": " << failed << ", \"faces\": " << faces
+               << ", \"seconds\": " << seconds << ", \"frames_per_second\": " << frames_per_second() << ", \"stages\": [";
+            for (unsigned long stage = 0; stage < STREAM_STAGE_NUM; ++ stage) {
+                const latency_stats &s = stages[stage];
+                os << (stage ? ", " : "") << "{\"name\": \"" << stream_stage_name(stage) << "\", \"workers\": " << workers[stage]
+                   << ", \"mean_ms\": " << s.mean << ", \"p50_ms\": " << s.p50 << ", \"p99_ms\": " << s.p99
+                   << ", \"max_ms\": " << s.max << ", \"busy\": " << busy[stage] << "}";
+            }
+            os << "], \"frame\": {\"mean_ms\": " << frame.mean << ", \"p50_ms\": " << frame.p50
+               << ", \"p99_ms\": " << frame.p99 << ", \"max_ms\": " << frame.max << "}}";
+            return os.str();
+        }
+    };
+    
+    /**
+     *  runs the images of paths through decode -> face detection with dlib's frontal
+     *  face detector -> landmarks by sp -> emit, every stage on its own threads and
+     *  connected to the next one by a bounded_queue, so at most queue_capacity frames
+     *  wait between two stages. emit is called for every frame on one thread, in the
+     *  order the frames finish, which need not be the order of paths.
+     */
+    stream_report run_landmark_stream(const std::vector<std::string> &paths, const compressed_shape_predictor &sp,
+                                      const stream_options &options,
+                                      const std::function<void(const stream_frame &)> &emit) {
+        typedef std::unique_ptr<stream_frame> frame_ptr;
+        typedef std::chrono::steady_clock clock;
+        bounded_queue<frame_ptr> decoded(options.queue_capacity), detected(options.queue_capacity), landmarked(options.queue_capacity);
+        std::atomic<uint64> next_path(0);
+        unsigned long workers[STREAM_STAGE_NUM];
+        std::unique_ptr<std::atomic<unsigned long>[]> running(new std::atomic<unsigned long>[STREAM_STAGE_NUM]);
+        for (unsigned long stage = 0; stage < STREAM_STAGE_NUM; ++ stage) {
+            workers[stage] = stage == STREAM_EMIT ? 1 : std::max(1ul, options.workers[stage]);
+            running[stage].store(workers[stage]);
+        }
+        auto elapsed_ms = [](clock::time_point since) {
+            return std::chrono::duration<double, std::milli>(clock::now() - since).count();
+        };
+        // the last worker of a stage to finish closes its output
+        auto finish = [&](unsigned long stage, bounded_queue<frame_ptr> &out) {
+            if (running[stage].fetch_sub(1) == 1) out.close();
+        };
+        
+        auto decode = [&]() {
+            for (;;) {
+                const uint64 index = next_path.fetch_add(1);
+                if (index >= paths.size()) break;
+                frame_ptr frame(new stream_frame());
+                frame->index = index;
+                frame->path = paths[index];
+                frame->start = clock::now();
+                try {
+                    dlib::load_image(frame->img, frame->path);
+                    frame->decoded = true;
+                } catch (std::exception &) {
+                    frame->decoded = false;
+                }
+                frame->stage_ms[STREAM_DECODE] = elapsed_ms(frame->start);
+                decoded.push(frame);
+            }
+            finish(STREAM_DECODE, decoded);
+        };
+        
+        auto detect = [&]() {
+            dlib::frontal_face_detector detector = dlib::get_frontal_face_detector();
+            frame_ptr frame;
+            while (decoded.pop(frame)) {
+                const clock::time_point start = clock::now();
+                if (frame->decoded) frame->faces = detector(frame->img);
+                frame->stage_ms[STREAM_DETECT] = elapsed_ms(start);
+                detected.push(frame);
+            }
+            finish(STREAM_DETECT, detected);
+        };
+        
+        auto landmark = [&]() {
+            frame_ptr frame;
+            while (detected.pop(frame)) {
+                const clock::time_point start = clock::now();
+                if (!frame->faces.empty()) frame->shapes = sp(frame->img, frame->faces);
+                frame->stage_ms[STREAM_LANDMARK] = elapsed_ms(start);
+                landmarked.push(frame);
+            }
+            finish(STREAM_LANDMARK, landmarked);
+        };
+        
+        stream_report report;
+        std::vector<double> stage_ms[STREAM_STAGE_NUM], frame_ms;
+        const clock::time_point start = clock::now();
+        std::vector<std::thread> threads;
+        for (unsigned long idx = 0; idx < workers[STREAM_DECODE]; ++ idx) threads.push_back(std::thread(decode));
+        for (unsigned long idx = 0; idx < workers[STREAM_DETECT]; ++ idx) threads.push_back(std::thread(detect));
+        for (unsigned long idx = 0; idx < workers[STREAM_LANDMARK]; ++ idx) threads.push_back(std::thread(landmark));
+        
+        // emit on this thread
+        frame_ptr frame;
+        while (landmarked.pop(frame)) {
+            const clock::time_point emit_start = clock::now();
+            emit(*frame);
+            frame->stage_ms[STREAM_EMIT] = elapsed_ms(emit_start);
+            for (unsigned long stage = 0; stage < STREAM_STAGE_NUM; ++ stage) stage_ms[stage].push_back(frame->stage_ms[stage]);
+            frame_ms.push_back(elapsed_ms(frame->start));
+            ++ report.frames;
+            report.failed += !frame->decoded;
+            report.faces += frame->faces.size();
+        }
+        for (auto &thread: threads) thread.join();
+        report.seconds = elapsed_ms(start) / 1000;
+        
+        for (unsigned long stage = 0; stage < STREAM_STAGE_NUM; ++ stage) {
+            report.workers[stage] = workers[stage];
+            report.stages[stage] = latency_stats::from(stage_ms[stage]);
+            if (report.seconds > 0) report.busy[stage] = report.stages[stage].total / 1000 / (report.seconds * workers[stage]);
+        }
+        report.frame = latency_stats::from(frame_ms);
+        return report;
+    }
+
+}
+
+#endif /* stream_pipeline_h */
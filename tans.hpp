@@ -0,0 +1,218 @@
+//
+//  tans.hpp
+//  dlib_utils
+//
+//  Created by zhaoyu on 2018/1/8.
+//  Copyright © 2018 zhaoyu. All rights reserved.
+
+#ifndef tans_h
+#define tans_h
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <queue>
+
+namespace med {
+
+    /**
+     * A tabled asymmetric numeral system (tANS) code. The normalized frequencies of
+     * the symbols sum to 2^table_log, and a symbol of frequency f costs very close
+     * to log2(2^table_log / f) bits, fractions of a bit included, where a Huffman
+     * code rounds every code to whole bits.
+     *
+     * The decoder state is an index into entries. Decoding a symbol looks up its
+     * entry and reads `bits` bits to form the next state. The encoder works on the
+     * symbols in reverse order, see encode_tans_block.
+     */
+    struct TansTable {
+        struct Entry {
+            int symbol;
+            unsigned short base;    // next state before the bits read are added
+            unsigned char bits;
+        };
+
+        unsigned int table_log;
+        std::vector< std::pair<int, unsigned int> > frequencies;   // (symbol, normalized frequency), by symbol
+        std::vector<Entry> entries;
+
+        // encoding: the states of symbol frequencies[k] for x in [f, 2f) are
+        // encode_states[encode_start[k] + x - f]
+        std::unordered_map<int, unsigned int> symbol_index;
+        std::vector<unsigned int> encode_start;
+        std::vector<unsigned int> encode_states;
+
+        TansTable() : table_log(0) {}
+    };
+
+    const unsigned int TANS_MIN_TABLE_LOG = 9;
+    const unsigned int TANS_MAX_TABLE_LOG = 15;
+
+    inline unsigned int floor_log2(unsigned long v) {
+        unsigned int n = 0;
+        while (v >>= 1) ++ n;
+        return n;
+    }
+
+    /**
+     * Scales symbol counts to frequencies summing to 2^table_log, every symbol
+     * keeping at least 1. Starting from 1 each, the remaining slots go one at a
+     * time to the symbol whose cost drops the most, count * log2((f + 1) / f),
+     * which gives the frequencies of the smallest cost; rounding the scaled counts
+     * instead wastes a lot on alphabets with many rare symbols.
+     */
+    std::vector< std::pair<int, unsigned int> > normalize_frequencies(const std::unordered_map<int, unsigned long> &counts,
+                                                                      unsigned int table_log) {
+        const unsigned long total = 1ul << table_log;
+        if (counts.size() > total) throw std::overflow_error("Too many symbols for a tANS table.");
+        
+        std::vector< std::pair<int, unsigned int> > freq;
+        std::vector<unsigned long> count;
+        for (auto &it: counts) freq.push_back(std::make_pair(it.first, 1u));
+        std::sort(freq.begin(), freq.end());
+        for (auto &it: freq) count.push_back(counts.at(it.first));
+        
+        // (gain of the next slot, symbol)
+        std::priority_queue< std::pair<double, unsigned long> > gains;
+        for (unsigned long k = 0; k < freq.size(); ++ k) {
+            gains.push(std::make_pair(count[k] * std::log2(2.0), k));
+        }
+        for (unsigned long slots = total - freq.size(); slots > 0; -- slots) {
+            const unsigned long k = gains.top().second;
+            gains.pop();
+            const double f = ++ freq[k].second;
+            gains.push(std::make_pair(count[k] * std::log2((f + 1) / f), k));
+        }
+        return freq;
+    }
+    
+    /**
+     * Builds the decode and encode tables from normalized frequencies. Symbols are
+     * spread over the states with the usual odd step, which interleaves them so
+     * that every symbol's states are spread over the whole range.
+     */
+    TansTable build_tans_table(const std::vector< std::pair<int, unsigned int> > &frequencies, unsigned int table_log) {
+        TansTable table;
+        table.table_log = table_log;
+        table.frequencies = frequencies;
+
+        const unsigned long size = 1ul << table_log;
+        const unsigned long mask = size - 1;
+        const unsigned long step = (size >> 1) + (size >> 3) + 3;
+        std::vector<unsigned int> spread(size);
+        unsigned long pos = 0, sum = 0;
+        for (unsigned long k = 0; k < frequencies.size(); ++ k) {
+            table.symbol_index[frequencies[k].first] = static_cast<unsigned int>(k);
+            table.encode_start.push_back(static_cast<unsigned int>(sum));
+            sum += frequencies[k].second;
+            for (unsigned int idx = 0; idx < frequencies[k].second; ++ idx) {
+                spread[pos] = static_cast<unsigned int>(k);
+                pos = (pos + step) & mask;
+            }
+        }
+        if (sum != size) throw std::invalid_argument("tANS frequencies do not sum to the table size.");
+
+        std::vector<unsigned int> next(frequencies.size());
+        for (unsigned long k = 0; k < frequencies.size(); ++ k) next[k] = frequencies[k].second;
+        table.entries.resize(size);
+        table.encode_states.resize(size);
+        for (unsigned long state = 0; state < size; ++ state) {
+            const unsigned int k = spread[state];
+            const unsigned int x = next[k] ++;
+            TansTable::Entry &e = table.entries[state];
+            e.symbol = frequencies[k].first;
+            e.bits = static_cast<unsigned char>(table_log - floor_log2(x));
+            e.base = static_cast<unsigned short>((x << e.bits) - size);
+            table.encode_states[table.encode_start[k] + x - frequencies[k].second] = static_cast<unsigned int>(state + size);
+        }
+        return table;
+    }
+
+    /**
+     * Number of bits the symbols with the given counts take in the code, without the
+     * block states.
+     */
+    double tans_cost_bits(const TansTable &table, const std::unordered_map<int, unsigned long> &counts) {
+        double bits = 0;
+        for (auto &it: table.frequencies) {
+            auto c = counts.find(it.first);
+            if (c != counts.end()) bits += c->second * (table.table_log - std::log2(static_cast<double>(it.second)));
+        }
+        return bits;
+    }
+
+    /**
+     * Table size for symbols with the given counts: the smallest one that costs at
+     * most 0.1% more than the largest. The cost of the rare symbols, which need a
+     * frequency of at least 1, shrinks with the table size while the decode table
+     * falls out of L1 cache above 2^12 entries.
+     */
+    unsigned int choose_table_log(const std::unordered_map<int, unsigned long> &counts) {
+        const unsigned long symbol_num = std::max<unsigned long>(1, counts.size());
+        if (symbol_num > (1ul << TANS_MAX_TABLE_LOG)) throw std::overflow_error("Too many symbols for a tANS table.");
+        const unsigned int min_table_log = std::max(TANS_MIN_TABLE_LOG, floor_log2(symbol_num - 1) + 2);
+        if (min_table_log >= TANS_MAX_TABLE_LOG) return TANS_MAX_TABLE_LOG;
+        
+        std::vector<double> cost;
+        for (unsigned int table_log = min_table_log; table_log <= TANS_MAX_TABLE_LOG; ++ table_log) {
+            cost.push_back(tans_cost_bits(build_tans_table(normalize_frequencies(counts, table_log), table_log), counts));
+        }
+        unsigned int idx = 0;
+        while (cost[idx] > cost.back() * 1.001) ++ idx;
+        return min_table_log + idx;
+    }
+    
+    /**
+     * Encodes a block of symbols, each of which must have a frequency. The block
+     * starts with the table_log bits of the initial decoder state, followed by the
+     * bits the decoder reads, in reading order. BitWriter must provide write(v, n);
+     * returns the number of bits written.
+     */
+    template <typename BitWriter>
+    unsigned long long encode_tans_block(const TansTable &table, const std::vector<int> &symbols, BitWriter &writer) {
+        const unsigned long size = 1ul << table.table_log;
+        // the encoder runs backwards, so the bits are collected and written in reverse
+        std::vector< std::pair<unsigned int, unsigned char> > chunks;
+        chunks.reserve(symbols.size());
+        unsigned long state = size;
+        for (auto it = symbols.rbegin(); it != symbols.rend(); ++ it) {
+            const unsigned int k = table.symbol_index.at(*it);
+            const unsigned long f = table.frequencies[k].second;
+            unsigned char bits = 0;
+            while ((state >> bits) >= 2 * f) ++ bits;
+            chunks.push_back(std::make_pair(static_cast<unsigned int>(state & ((1ul << bits) - 1)), bits));
+            state = table.encode_states[table.encode_start[k] + (state >> bits) - f];
+        }
+
+        unsigned long long bits_num = table.table_log;
+        writer.write(static_cast<unsigned int>(state - size), table.table_log);
+        for (auto it = chunks.rbegin(); it != chunks.rend(); ++ it) {
+            if (it->second) writer.write(it->first, it->second);
+            bits_num += it->second;
+        }
+        return bits_num;
+    }
+
+    /**
+     * Reads the initial state of a block.
+     */
+    template <typename BitReader>
+    inline unsigned int start_tans_block(const TansTable &table, BitReader &reader) {
+        return reader.read(table.table_log);
+    }
+
+    /**
+     * Decodes one symbol and moves to the next state. BitReader must provide read(n)
+     * for 0 <= n <= 32.
+     */
+    template <typename BitReader>
+    inline int decode_tans_symbol(const TansTable &table, unsigned int &state, BitReader &reader) {
+        const TansTable::Entry &e = table.entries[state];
+        state = e.base + reader.read(e.bits);
+        return e.symbol;
+    }
+}
+
+#endif /* tans_h */
@@ -0,0 +1,109 @@
+//
+//  tune.cpp
+//  dlib_utils
+//
+//  Created by zhaoyu on 2018/1/8.
+//  Copyright © 2018 zhaoyu. All rights reserved.
+//
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <thread>
+
+#include <model_utils.hpp>
+#include <eval_utils.hpp>
+#include <dlib/image_processing.h>
+
+/**
+ *  compress a dlib model with every combination of prune threshold, quantization
+ *  number and quantizer in parallel, score every candidate by its landmark
+ *  deviation from the original model, and save the smallest one within the error
+ *  budget to dest_path
+ */
+int main(int argc, const char * argv[]) {
+    
+    if (argc < 3) {
+        std::cout << "Usage: ./tune.bin src_path dest_path [--images dir] [--synthetic 50] "
+                     "[--prune 0,0.0001,0.0003,0.001,0.003] [--quant 64,128,256,512,1024,2048] "
+                     "[--quantizer model,level,coordinate] [--packed_splits 1] [--coded_splits 1] [--codebook 4096] [--max_mean_rel 0.002] "
+                     "[--max_rel 0.02] [--max_mean_px 0.5] [--max_px 5] [--threads 4]" << std::endl;
+        return 0;
+    }
+    
+    std::string image_dir;
+    std::vector<float> prune_list = {0.0f, 0.0001f, 0.0003f, 0.001f, 0.003f};
+    std::vector<unsigned long long> quant_list = {64, 128, 256, 512, 1024, 2048};
+    std::vector<std::string> quantizer_list = {"model", "level", "coordinate"};
+    unsigned long synthetic_num = 50;
+    unsigned long num_threads = 0;
+    med::compression_options options;
+    med::error_budget budget;
+    budget.mean_relative = 0.002;
+    for (int idx = 3; idx + 1 < argc; idx += 2) {
+        std::string key = argv[idx];
+        if (key == "--images") image_dir = argv[idx + 1];
+        else if (key == "--synthetic") synthetic_num = med::parse_list<unsigned long>(argv[idx + 1]).at(0);
+        else if (key == "--prune") prune_list = med::parse_list<float>(argv[idx + 1]);
+        else if (key == "--quant") quant_list = med::parse_list<unsigned long long>(argv[idx + 1]);
+        else if (key == "--quantizer") quantizer_list = med::parse_list<std::string>(argv[idx + 1]);
+        else if (key == "--packed_splits") options.packed_splits = std::string(argv[idx + 1]) != "0";
+        else if (key == "--coded_splits") options.coded_splits = std::string(argv[idx + 1]) != "0";
+        else if (key == "--codebook") options.leaf_codebook_size = med::parse_list<unsigned long long>(argv[idx + 1]).at(0);
+        else if (key == "--max_mean_rel") budget.mean_relative = med::parse_list<double>(argv[idx + 1]).at(0);
+        else if (key == "--max_rel") budget.max_relative = med::parse_list<double>(argv[idx + 1]).at(0);
+        else if (key == "--max_mean_px") budget.mean = med::parse_list<double>(argv[idx + 1]).at(0);
+        else if (key == "--max_px") budget.max = med::parse_list<double>(argv[idx + 1]).at(0);
+        else if (key == "--threads") num_threads = med::parse_list<unsigned long>(argv[idx + 1]).at(0);
+    }
+    std::vector<med::quantizer_type> quantizers;
+    for (auto &name: quantizer_list) quantizers.push_back(med::parse_quantizer(name));
+    
+    dlib::shape_predictor sp;
+    dlib::deserialize(argv[1]) >> sp;
+    
+    // real images when given, synthetic ones in any case, so that a small image set
+    // still exercises many face positions and sizes
+    std::vector<med::eval_sample> samples, synthetic;
+    if (!image_dir.empty()) med::load_image_samples(image_dir, samples);
+    med::make_synthetic_samples(synthetic, synthetic_num);
+    samples.insert(samples.end(), synthetic.begin(), synthetic.end());
+    
+    std::vector<med::tuning_candidate> candidates;
+    std::string best_model;
+    med::stopwatch watch;
+    long best = med::tune_compression(sp, samples, prune_list, quant_list, quantizers, options, budget,
+                                      candidates, best_model, num_threads);
+    
+    std::cout << "model: " << argv[1] << ", " << med::file_size(argv[1]) / 1024 << " KB, "
+              << samples.size() << " images, " << candidates.size() << " candidates in "
+              << std::fixed << std::setprecision(1) << watch.elapsed_ms() / 1000 << " s" << std::endl;
+    std::cout << std::setw(10) << "prune" << std::setw(8) << "quant" << std::setw(12) << "quantizer"
+              << std::setw(10) << "size_kb" << std::setw(10) << "mean_px" << std::setw(10) << "max_px"
+              << std::setw(10) << "mean_rel" << std::setw(10) << "max_rel" << std::endl;
+    for (unsigned long idx = 0; idx < candidates.size(); ++ idx) {
+        const med::tuning_candidate &candidate = candidates[idx];
+        std::cout << std::setw(10) << std::setprecision(6) << std::defaultfloat << candidate.options.prune_thresh
+                  << std::setw(8) << candidate.options.quantization_num
+                  << std::setw(12) << quantizer_list[idx % quantizer_list.size()]
+                  << std::fixed << std::setprecision(1) << std::setw(10) << candidate.size / 1024.0
+                  << std::setprecision(3) << std::setw(10) << candidate.deviation.mean << std::setw(10) << candidate.deviation.max
+                  << std::setprecision(5) << std::setw(10) << candidate.deviation.mean_relative
+                  << std::setw(10) << candidate.deviation.max_relative
+                  << (static_cast<long>(idx) == best ? "  <- best" : (candidate.accepted ? "" : "  over budget"))
+                  << std::endl;
+    }
+    
+    if (best < 0) {
+        std::cout << "No candidate is within the error budget." << std::endl;
+        return 1;
+    }
+    std::ofstream os(argv[2], std::ofstream::binary);
+    os.write(best_model.data(), best_model.size());
+    if (!os) {
+        std::cout << "Unable to write " << argv[2] << "." << std::endl;
+        return 1;
+    }
+    std::cout << "saved " << argv[2] << ", " << best_model.size() / 1024 << " KB" << std::endl;
+    return 0;
+}